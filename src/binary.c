@@ -0,0 +1,367 @@
+/* applying git binary diffs */
+
+/* Copyright 2026 Free Software Foundation, Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include <common.h>
+
+#include <quotearg.h>
+#include <util.h>
+#include <xalloc.h>
+
+#include <binary.h>
+#include <inp.h>
+#include <pch.h>
+
+#if HAVE_ZLIB
+
+#include <zlib.h>
+
+/* Inflate at most this many bytes at a time.  */
+enum { INFLATE_BUFSIZE = 64 * 1024 };
+
+/* The data of a hunk, inflated as it is read from the patch.  */
+struct inflater
+{
+  z_stream z;
+  unsigned char in[52];		/* one decoded line of the patch */
+  unsigned char out[INFLATE_BUFSIZE]; /* inflated data */
+  unsigned char const *next;	/* next byte of inflated data to use */
+  bool end;			/* whether the data has all been inflated */
+  bool bad;			/* whether the data is corrupt */
+};
+
+/* The output of a hunk, and its git object checksum so far.  */
+struct binary_output
+{
+  FILE *ofp;			/* where to write it, if anywhere */
+  struct sha1_ctx sha1;
+  intmax_t total;		/* number of bytes in all */
+  intmax_t size;		/* number of bytes left to output */
+};
+
+static bool inflate_more (struct inflater *);
+static idx_t inflated (struct inflater *, unsigned char const **, idx_t);
+static bool read_size (struct inflater *, intmax_t *);
+static bool sha1_matches (struct sha1_ctx *, char const *);
+static bool write_binary (struct binary_output *, void const *, idx_t);
+static bool apply_delta (struct inflater *, struct binary_output *,
+			 struct iline);
+static FILE *make_binary_tempfile (void);
+
+/* Inflate some more of the hunk data into the output buffer, and
+   return false if there is no more.  */
+
+static bool
+inflate_more (struct inflater *inf)
+{
+  inf->z.next_out = inf->out;
+  inf->z.avail_out = sizeof inf->out;
+  inf->next = inf->out;
+
+  while (! inf->end && ! inf->bad && inf->z.next_out == inf->out)
+    {
+      if (! inf->z.avail_in)
+	{
+	  int n = pch_binary_line ((char *) inf->in);
+	  if (! n)
+	    {
+	      inf->bad = true;
+	      break;
+	    }
+	  inf->z.next_in = inf->in;
+	  inf->z.avail_in = n;
+	}
+      switch (inflate (&inf->z, Z_NO_FLUSH))
+	{
+	case Z_OK:
+	  break;
+	case Z_STREAM_END:
+	  inf->end = true;
+	  break;
+	case Z_MEM_ERROR:
+	  xalloc_die ();
+	default:
+	  inf->bad = true;
+	  break;
+	}
+    }
+
+  return inf->next < inf->z.next_out;
+}
+
+/* Set *DATA to up to SIZE bytes of inflated data, and return their
+   number, which is 0 if there is no more data.  */
+
+static idx_t
+inflated (struct inflater *inf, unsigned char const **data, idx_t size)
+{
+  if (inf->next == inf->z.next_out && ! inflate_more (inf))
+    return 0;
+  idx_t n = MIN (size, inf->z.next_out - inf->next);
+  *data = inf->next;
+  inf->next += n;
+  return n;
+}
+
+/* Read a size from the header of a delta into *SIZE.
+   Sizes are little-endian, seven bits per byte, and the top bit
+   of each byte but the last is set.  */
+
+static bool
+read_size (struct inflater *inf, intmax_t *size)
+{
+  intmax_t s = 0;
+  for (int shift = 0; ; shift += 7)
+    {
+      unsigned char const *p;
+      if (! inflated (inf, &p, 1) || INTMAX_WIDTH - 8 < shift)
+	return false;
+      s |= (intmax_t) (*p & 0x7f) << shift;
+      if (! (*p & 0x80))
+	break;
+    }
+  *size = s;
+  return true;
+}
+
+/* Is the checksum in CTX the one whose hex digits are in SHA1?  */
+
+static bool
+sha1_matches (struct sha1_ctx *ctx, char const *sha1)
+{
+  unsigned char sum[SHA1_DIGEST_SIZE];
+  sha1_finish_ctx (ctx, sum);
+  return sha1_hex_matches (sum, sha1, SHA1_HEX_DIGITS);
+}
+
+/* Output SIZE bytes at DATA, and return false if there are more
+   bytes than the hunk said.  */
+
+static bool
+write_binary (struct binary_output *out, void const *data, idx_t size)
+{
+  if (out->size < size)
+    return false;
+  out->size -= size;
+  sha1_process_bytes (data, size, &out->sha1);
+  if (out->ofp)
+    Fwrite (data, 1, size, out->ofp);
+  return true;
+}
+
+/* Output the result of applying the delta in the hunk data to the
+   input file IN.  The data starts with the sizes of the input and
+   the output, followed by instructions to copy spans of the input
+   and to insert spans of the data itself.  */
+
+static bool
+apply_delta (struct inflater *inf, struct binary_output *out, struct iline in)
+{
+  intmax_t in_size;
+  if (! read_size (inf, &in_size) || in_size != in.size
+      || ! read_size (inf, &out->total))
+    return false;
+  out->size = out->total;
+  start_git_blob (&out->sha1, out->total);
+
+  unsigned char const *p;
+  while (inflated (inf, &p, 1))
+    {
+      unsigned char op = *p;
+      if (op & 0x80)
+	{
+	  /* Bits 0-3 say which bytes of the offset follow, and bits
+	     4-6 which bytes of the size; a size of 0 means 0x10000.  */
+	  uint_least32_t offset = 0, size = 0;
+	  for (int i = 0; i < 7; i++)
+	    if (op & (1 << i))
+	      {
+		if (! inflated (inf, &p, 1))
+		  return false;
+		if (i < 4)
+		  offset |= (uint_least32_t) *p << (8 * i);
+		else
+		  size |= (uint_least32_t) *p << (8 * (i - 4));
+	      }
+	  if (! size)
+	    size = 0x10000;
+	  if (in.size < offset || in.size - offset < size
+	      || ! write_binary (out, in.ptr + offset, size))
+	    return false;
+	}
+      else if (op)
+	{
+	  /* Insert the next OP bytes of the data.  */
+	  for (idx_t n; op; op -= n)
+	    {
+	      n = inflated (inf, &p, op);
+	      if (! n || ! write_binary (out, p, n))
+		return false;
+	    }
+	}
+      else
+	return false;
+    }
+  return true;
+}
+
+/* Return a stream on a new, already removed temporary file, to hold
+   output that must be checked before it is copied elsewhere.  */
+
+static FILE *
+make_binary_tempfile (void)
+{
+  struct outfile tmp = { .temporary = true };
+  int fd = make_tempfile (&tmp, 'b', nullptr, O_RDWR | binary_transput,
+			  0600);
+  if (fd < 0)
+    pfatal ("Can't create temporary file %s", tmp.name);
+  if (unlink (tmp.name) < 0)
+    pfatal ("Can't remove temporary file %s", tmp.name);
+  free (tmp.alloc);
+  FILE *fp = fdopen (fd, binary_transput ? "w+b" : "w+");
+  if (! fp)
+    pfatal ("fdopen");
+  return fp;
+}
+
+/* Apply the git binary diff at the current position in the patch to
+   the input file, writing the result to OUTSTATE, and set *ST to the
+   status of the output file.  Check the input and the output against
+   the checksums of the diff.  The data is inflated and applied as it
+   is read, so that large files need not be held in memory.  With -o,
+   output nothing unless the checks pass.  */
+
+bool
+apply_binary_patch (char const *name, struct outstate *outstate,
+		    struct stat *st)
+{
+  struct iline in = input_tail (1);
+  char const *old_sha1 = pch_sha1 (reverse_flag);
+  char const *new_sha1 = pch_sha1 (! reverse_flag);
+  bool check_old = old_sha1 && pch_says_nonexistent (reverse_flag) != 2;
+  bool check_new = new_sha1 && pch_says_nonexistent (! reverse_flag) != 2;
+
+  /* Git writes full checksums for binary diffs; an abbreviated one
+     cannot tell the right file from another.  */
+  if ((check_old && strlen (old_sha1) < SHA1_HEX_DIGITS)
+      || (check_new && strlen (new_sha1) < SHA1_HEX_DIGITS))
+    {
+      say ("File %s: git binary diff has no full index line -- "
+	   "not patching\n", quotearg (name));
+      return false;
+    }
+
+  if (check_old)
+    {
+      unsigned char sum[SHA1_DIGEST_SIZE];
+      input_sha1 (sum);
+      if (! sha1_hex_matches (sum, old_sha1, SHA1_HEX_DIGITS))
+	{
+	  say ("File %s does not match the git binary diff -- "
+	       "not patching\n", quotearg (name));
+	  return false;
+	}
+    }
+
+  bool delta;
+  intmax_t size = pch_binary_hunk (reverse_flag, &delta);
+  if (size < 0)
+    {
+      say ("File %s: git binary diff cannot be reversed\n",
+	   quotearg (name));
+      return false;
+    }
+
+  struct inflater inf = { 0 };
+  int err = inflateInit (&inf.z);
+  if (err != Z_OK)
+    {
+      if (err == Z_MEM_ERROR)
+	xalloc_die ();
+      fatal ("zlib initialization failed: %s", inf.z.msg);
+    }
+  inf.next = inf.z.next_out = inf.out;
+
+  /* With -o, the output of other files shares OUTSTATE, so output
+     nothing there until the data has been checked: write it to a
+     temporary file, and copy that once it is known to be good.  */
+  FILE *tmpfp = outstate->ofp && outfile ? make_binary_tempfile () : nullptr;
+
+  struct binary_output out = { .ofp = tmpfp ? tmpfp : outstate->ofp,
+				.total = size, .size = size };
+  bool ok;
+  if (delta)
+    ok = apply_delta (&inf, &out, in);
+  else
+    {
+      start_git_blob (&out.sha1, size);
+      unsigned char const *p;
+      idx_t n;
+      ok = true;
+      while (ok && (n = inflated (&inf, &p, sizeof inf.out)))
+	ok = write_binary (&out, p, n);
+    }
+  ok &= inf.end && ! out.size && inf.z.total_out == size;
+  inflateEnd (&inf.z);
+
+  /* Skip any data after the end of the deflated stream.  */
+  char buf[52];
+  while (pch_binary_line (buf))
+    ok = false;
+
+  if (ok && new_sha1)
+    ok = check_new ? sha1_matches (&out.sha1, new_sha1) : ! out.total;
+  if (! ok)
+    {
+      if (tmpfp)
+	Fclose (tmpfp);
+      say ("File %s: git binary diff is corrupt\n", quotearg (name));
+      return false;
+    }
+
+  if (tmpfp)
+    {
+      Fseeko (tmpfp, 0, SEEK_SET);
+      size_t n;
+      while ((n = fread (inf.out, 1, sizeof inf.out, tmpfp)))
+	Fwrite (inf.out, 1, n, outstate->ofp);
+      if (ferror (tmpfp))
+	read_fatal ();
+      Fclose (tmpfp);
+    }
+
+  outstate->zero_output = ! out.total;
+  if (outstate->ofp && ! outfile)
+    {
+      Fflush (outstate->ofp);
+      if (fstat (fileno (outstate->ofp), st) < 0)
+	write_fatal ();
+    }
+  return true;
+}
+
+#else
+
+bool
+apply_binary_patch (char const *name, MAYBE_UNUSED struct outstate *outstate,
+		    MAYBE_UNUSED struct stat *st)
+{
+  say ("File %s: git binary diffs are not supported.\n", quotearg (name));
+  return false;
+}
+
+#endif
@@ -105,6 +105,8 @@ extern intmax_t patch_get;
 extern bool set_time;
 extern bool set_utc;
 extern bool follow_symlinks;
+extern bool fsync_output;
+extern intmax_t jobs;
 
 enum diff
   {
@@ -165,6 +167,9 @@ extern ptrdiff_t out_offset;
 extern idx_t last_frozen_line;
 
 bool copy_till (struct outstate *, idx_t);
+void output_text (struct outstate *, char const *, idx_t);
+void output_string (struct outstate *, char const *);
+bool output_pch_line (struct outstate *, idx_t);
 bool similar (char const *, idx_t, char const *, idx_t) ATTRIBUTE_PURE;
 
 #ifdef ENABLE_MERGE
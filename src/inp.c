@@ -25,12 +25,55 @@
 #include <inp.h>
 #include <safe.h>
 
-/* Input-file-with-indexable-lines abstract type */
+#if HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
-static char *i_buffer;			/* buffer of input file lines */
-static char const **i_ptr;		/* pointers to lines in buffer */
-idx_t input_lines;			/* how long is input file in lines */
+/* Input-file-with-indexable-lines abstract type.
+
+   Lines are indexed lazily, as callers ask for them: the forward index
+   covers only as many lines as have been fetched so far, and lines near
+   the end of a file can be indexed backwards from EOF without indexing
+   everything in between.
+
+   To keep the forward index small for files with many short lines, it
+   records where each line starts as a 32-bit offset from the start of
+   its block of I_BLOCK_LINES lines.  In the unlikely event that a block
+   is too long for that, the index switches to full-width offsets.
+
+   When a hunk must be searched for far from where the patch says it is,
+   the search compares hashes of the input lines rather than the lines
+   themselves.  With --ignore-whitespace, lines are compared by hash
+   before being compared by similar (), so each line's hash is computed
+   only once and is kept.  Once hashes are needed for a search, the
+   lines are also indexed by hash, so that a search can go straight to
+   the places where a given line occurs.  */
+
+enum { I_BLOCK_BITS = 16, I_BLOCK_LINES = 1 << I_BLOCK_BITS };
 
+static char *i_buffer;			/* buffer of input file lines */
+static char const *i_lim;		/* end of i_buffer */
+static idx_t i_mapped;			/* size of i_buffer if mapped, else 0 */
+static uint_least32_t *i_off;		/* line starts relative to block */
+static idx_t i_noff;			/* allocated size of i_off */
+static idx_t *i_wide;			/* line starts, if i_off won't do */
+static idx_t i_nwide;			/* allocated size of i_wide */
+static idx_t *i_base;			/* where each block starts */
+static idx_t i_nbase;			/* allocated size of i_base */
+static idx_t i_lines;			/* number of lines in forward index */
+static idx_t i_total;			/* number of lines, or -1 if unknown */
+static char const **i_tail;		/* pointers to last lines, last first */
+static idx_t i_ntail;			/* number of lines indexed by i_tail */
+static idx_t i_ntailalloc;		/* allocated size of i_tail */
+static uint_least32_t *i_hash;		/* hash of each line, 0 if not known */
+static bool i_hashed;			/* whether all of i_hash is known */
+static idx_t *i_bystart;		/* where each bucket starts in i_byline */
+static idx_t *i_byline;			/* line numbers, bucketed by hash */
+static uint_least32_t i_bymask;		/* number of buckets, minus 1 */
+static int i_fd = -1;			/* regular input file, or -1 */
+
+static char *map_input (int, idx_t);
+static void index_line_hashes (void);
 static void report_revision (bool);
 
 /* New patch--prepare to edit another file. */
@@ -40,10 +83,37 @@ re_input (void)
 {
       if (i_buffer)
 	{
-	  free (i_buffer);
+#if HAVE_MMAP
+	  if (i_mapped)
+	    {
+	      munmap (i_buffer, i_mapped);
+	      i_mapped = 0;
+	    }
+	  else
+#endif
+	    free (i_buffer);
 	  i_buffer = 0;
-	  free (i_ptr);
 	}
+      if (i_wide)
+	{
+	  free (i_wide);
+	  i_wide = nullptr;
+	  i_nwide = 0;
+	}
+      if (i_hash)
+	{
+	  free (i_hash);
+	  i_hash = nullptr;
+	  i_hashed = false;
+	}
+      if (i_bystart)
+	{
+	  free (i_bystart);
+	  free (i_byline);
+	  i_bystart = i_byline = nullptr;
+	}
+      i_lines = i_total = i_ntail = 0;
+      i_fd = -1;
 }
 
 /* Report whether a desired revision was found.  */
@@ -155,6 +225,42 @@ get_input_file (char *filename, char const *outname, mode_t file_type)
 }
 
 
+/* Map the first SIZE bytes of the regular file IFD into memory and
+   return the mapping.  Return a null pointer if the file is too small
+   for mapping to pay off, or if it cannot be mapped; the caller then
+   reads the file instead.  */
+
+static char *
+map_input (int ifd, idx_t size)
+{
+#if HAVE_MMAP
+  /* Don't map past end of file, as accessing such pages would fault.  */
+  struct stat st;
+  if (size < IO_BUFSIZE || fstat (ifd, &st) != 0 || st.st_size < size)
+    return nullptr;
+
+  void *p = mmap (nullptr, size, PROT_READ, MAP_PRIVATE, ifd, 0);
+  if (p == MAP_FAILED)
+    return nullptr;
+
+# if HAVE_MADVISE
+  /* The file is indexed front to back right away, so ask for
+     aggressive read-ahead.  */
+#  ifdef MADV_SEQUENTIAL
+  madvise (p, size, MADV_SEQUENTIAL);
+#  endif
+#  ifdef MADV_WILLNEED
+  madvise (p, size, MADV_WILLNEED);
+#  endif
+# endif
+
+  i_mapped = size;
+  return p;
+#else
+  return nullptr;
+#endif
+}
+
 /* Read input and build its line index.  */
 
 void
@@ -165,11 +271,15 @@ scan_input (char *filename, mode_t file_type, int ifd)
   idx_t size;
   if (ckd_add (&size, instat.st_size, 0))
     xalloc_die ();
-  char *buffer = ximalloc (size);
+
+  /* Map large regular files rather than copying them.  */
+  char *buffer = S_ISREG (file_type) ? map_input (ifd, size) : nullptr;
+  if (! buffer)
+    buffer = ximalloc (size);
 
   /* Read the input file, but don't bother reading it if it's empty.
      When creating files, the files do not actually exist.  */
-  if (size)
+  if (size && ! i_mapped)
     {
       if (S_ISREG (file_type))
         {
@@ -197,23 +307,20 @@ scan_input (char *filename, mode_t file_type, int ifd)
 	}
   }
 
-  /* Scan the buffer and build array of pointers to lines.  */
   char const *lim = buffer + size;
-  idx_t iline = 3; /* 1 unused, 1 for SOF,
-		      1 for EOF if last line is incomplete.  */
-  for (char const *s = buffer;  (s = memchr (s, '\n', lim - s));  s++)
-    iline++;
-  char const **ptr = xireallocarray (nullptr, iline, sizeof *ptr);
-  iline = 0;
-  for (char const *s = buffer; ; s++)
+  i_buffer = buffer;
+  i_lim = lim;
+  i_fd = S_ISREG (file_type) ? ifd : -1;
+  if (! i_off)
     {
-      ptr[++iline] = s;
-      if (! (s = memchr (s, '\n', lim - s)))
-	break;
+      i_off = xpalloc (nullptr, &i_noff, 3, -1, sizeof *i_off);
+      i_base = xpalloc (nullptr, &i_nbase, 1, -1, sizeof *i_base);
     }
-  if (size && lim[-1] != '\n')
-    ptr[++iline] = lim;
-  input_lines = iline - 1;
+  i_base[0] = 0;
+  i_off[1] = 0;
+  i_lines = 0;
+  i_total = -1;
+  i_ntail = 0;
 
   if (revision)
     {
@@ -238,19 +345,363 @@ scan_input (char *filename, mode_t file_type, int ifd)
 
       report_revision (found_revision);
     }
+}
 
-  i_buffer = buffer;
-  i_ptr = ptr;
+/* Return the offset of the start of LINE, which must be in the forward
+   index or be the line just after it.  */
+
+static idx_t
+line_start (idx_t line)
+{
+  return i_wide ? i_wide[line] : i_base[line >> I_BLOCK_BITS] + i_off[line];
+}
+
+/* Record that LINE starts at offset OFF.  LINE must be the line after
+   the last one recorded.  */
+
+static void
+set_line_start (idx_t line, idx_t off)
+{
+  if (i_wide)
+    {
+      if (i_nwide <= line)
+	i_wide = xpalloc (i_wide, &i_nwide, 1, -1, sizeof *i_wide);
+      i_wide[line] = off;
+      return;
+    }
+
+  if (i_noff <= line)
+    i_off = xpalloc (i_off, &i_noff, 1, -1, sizeof *i_off);
+
+  idx_t block = line >> I_BLOCK_BITS;
+  if (! (line & (I_BLOCK_LINES - 1)))
+    {
+      if (i_nbase <= block)
+	i_base = xpalloc (i_base, &i_nbase, 1, -1, sizeof *i_base);
+      i_base[block] = off;
+    }
+
+  idx_t rel = off - i_base[block];
+  if (rel <= UINT_LEAST32_MAX)
+    i_off[line] = rel;
+  else
+    {
+      /* The block is too long for 32-bit offsets.  */
+      i_nwide = i_noff;
+      idx_t *wide = xireallocarray (nullptr, i_nwide, sizeof *wide);
+      for (idx_t i = 1; i < line; i++)
+	wide[i] = line_start (i);
+      wide[line] = off;
+      i_wide = wide;
+    }
+}
+
+/* Extend the forward index so that it covers LINE, or as much of the
+   file as there is if LINE is past end of file.  */
+
+static void
+index_lines (idx_t line)
+{
+  char const *lim = i_lim;
+
+  while (i_lines < line)
+    {
+      char const *s = i_buffer + line_start (i_lines + 1);
+      if (s == lim)
+	{
+	  i_total = i_lines;
+	  break;
+	}
+
+      char const *nl = memchr (s, '\n', lim - s);
+      i_lines++;
+      set_line_start (i_lines + 1, (nl ? nl + 1 : lim) - i_buffer);
+    }
+}
+
+/* Return the number of lines in the input file.  This counts the
+   lines not yet indexed, but does not index them.  */
+
+idx_t
+input_lines (void)
+{
+  if (i_total < 0)
+    {
+      char const *lim = i_lim;
+      char const *s = i_buffer + line_start (i_lines + 1);
+      idx_t n = i_lines + (s < lim && lim[-1] != '\n');
+      for (; (s = memchr (s, '\n', lim - s)); s++)
+	n++;
+      i_total = n;
+    }
+  return i_total;
+}
+
+/* Does the input file have at least N lines?  */
+
+bool
+input_has_lines (idx_t n)
+{
+  if (i_lines < n && i_total < 0)
+    index_lines (n);
+  return n <= (i_total < 0 ? i_lines : i_total);
+}
+
+/* Fetch LINE, which is past the forward index but not past end of file,
+   by indexing backwards from EOF.  */
+
+static struct iline
+ifetch_tail (idx_t line)
+{
+  idx_t j = i_total - line;
+
+  while (i_ntail <= j)
+    {
+      /* The line before the earliest one indexed so far ends just before
+	 that one starts, so look for the newline before that.  */
+      char const *end = i_ntail ? i_tail[i_ntail - 1] : i_lim;
+      char const *nl = memrchr (i_buffer, '\n', end - 1 - i_buffer);
+      if (i_ntail == i_ntailalloc)
+	i_tail = xpalloc (i_tail, &i_ntailalloc, 1, -1, sizeof *i_tail);
+      i_tail[i_ntail++] = nl ? nl + 1 : i_buffer;
+    }
+
+  char const *ptr = i_tail[j];
+  return (struct iline) { .ptr = ptr,
+			  .size = (j ? i_tail[j - 1] : i_lim) - ptr };
 }
 
-/* Fetch a line from the input file.  */
+/* Fetch a line from the input file.  Return an empty line
+   if LINE is out of range.  */
 
 struct iline
 ifetch (idx_t line)
 {
-  if (! (1 <= line && line <= input_lines))
+  if (i_lines < line)
+    {
+      if (0 <= i_total && i_total < line)
+	return (struct iline) { .ptr = "", .size = 0 };
+
+      /* Once the number of lines is known, index backwards from EOF
+	 if that is less work.  */
+      if (0 <= i_total && i_total - line < line - i_lines)
+	return ifetch_tail (line);
+
+      index_lines (line);
+      if (i_lines < line)
+	return (struct iline) { .ptr = "", .size = 0 };
+    }
+  else if (line < 1)
     return (struct iline) { .ptr = "", .size = 0 };
 
-  char const *ptr = i_ptr[line];
-  return (struct iline) { .ptr = ptr, .size = i_ptr[line + 1] - ptr };
+  idx_t start = line_start (line);
+  return (struct iline) { .ptr = i_buffer + start,
+			  .size = line_start (line + 1) - start };
+}
+
+/* Return the contents of the input file from the start of LINE through
+   end of file, without indexing the lines in between.  */
+
+struct iline
+input_tail (idx_t line)
+{
+  struct iline l = ifetch (line);
+  return (struct iline) { .ptr = l.ptr, .size = l.size ? i_lim - l.ptr : 0 };
+}
+
+/* Set SUM, which has room for SHA1_DIGEST_SIZE bytes, to the git
+   object checksum of the input file.  */
+
+void
+input_sha1 (unsigned char *sum)
+{
+  struct iline in = input_tail (1);
+  struct sha1_ctx ctx;
+  start_git_blob (&ctx, in.size);
+  sha1_process_bytes (in.ptr, in.size, &ctx);
+  sha1_finish_ctx (&ctx, sum);
+}
+
+/* Copy to the file descriptor OFD the SIZE bytes of input at PTR, by
+   having the kernel copy them from the input file, which on some file
+   systems shares their storage instead.  If OFD is a pipe, have the
+   kernel splice the file's pages into it.  Return the number of bytes
+   copied, which is less than SIZE if the kernel cannot do it all; the
+   caller should write the rest.  */
+
+idx_t
+copy_input_range (int ofd, char const *ptr, idx_t size)
+{
+  idx_t copied = 0;
+
+  if (0 <= i_fd)
+    {
+      off_t off = ptr - i_buffer;
+#if HAVE_SPLICE
+      bool splicing = false;
+#endif
+      while (copied < size)
+	{
+	  ssize_t n;
+#if HAVE_SPLICE
+	  if (splicing)
+	    n = splice (i_fd, &off, ofd, nullptr, size - copied, 0);
+	  else
+#endif
+	    n = copy_file_range (i_fd, &off, ofd, nullptr, size - copied, 0);
+#if HAVE_SPLICE
+	  /* copy_file_range fails with EINVAL if OFD is a pipe.  */
+	  if (n < 0 && errno == EINVAL && ! splicing)
+	    {
+	      splicing = true;
+	      continue;
+	    }
+#endif
+	  if (n <= 0)
+	    break;
+	  copied += n;
+	}
+    }
+
+  return copied;
+}
+
+/* Hash the SIZE bytes of LINE, consistently with how patch_match
+   compares lines: with --ignore-whitespace, lines that are similar ()
+   hash alike.  */
+
+uint_least32_t
+hash_line (char const *line, idx_t size)
+{
+  unsigned char const *p = (unsigned char const *) line;
+  unsigned char const *lim = p + size;
+  uint_fast64_t h = 0xcbf29ce484222325;
+
+  if (canonicalize_ws)
+    {
+      /* Hash the line as if its trailing newline and white space were
+	 removed and each other run of blanks were a single space.  */
+      lim -= p < lim && lim[-1] == '\n';
+      while (p < lim && c_isblank (lim[-1]))
+	lim--;
+      while (p < lim)
+	{
+	  unsigned char c = *p++;
+	  if (c_isblank (c))
+	    {
+	      c = ' ';
+	      while (c_isblank (*p))
+		p++;
+	    }
+	  h = (h ^ c) * 0x100000001b3;
+	}
+    }
+  else
+    while (p < lim)
+      h = (h ^ *p++) * 0x100000001b3;
+
+  /* Never return 0, so that i_hash can use it for a hash not yet
+     computed.  */
+  uint_least32_t r = h ^ h >> 32;
+  return r + !r;
+}
+
+/* Return the hash_line of LINE, which may be out of range.  */
+
+uint_least32_t
+input_line_hash (idx_t line)
+{
+  idx_t n = input_lines ();
+  if (! (1 <= line && line <= n))
+    return hash_line ("", 0);
+  if (! i_hash)
+    i_hash = xicalloc (n + 1, sizeof *i_hash);
+  if (! i_hash[line])
+    {
+      struct iline l = ifetch (line);
+      i_hash[line] = hash_line (l.ptr, l.size);
+    }
+  return i_hash[line];
+}
+
+/* Return the hashes of all the input lines, indexed by line number.  */
+
+uint_least32_t const *
+input_line_hashes (void)
+{
+  idx_t n = input_lines ();
+  if (! i_hash)
+    i_hash = xicalloc (n + 1, sizeof *i_hash);
+  if (! i_hashed)
+    for (idx_t line = 1; line <= n; line++)
+      if (! i_hash[line])
+	{
+	  struct iline l = ifetch (line);
+	  i_hash[line] = hash_line (l.ptr, l.size);
+	}
+  i_hashed = true;
+  return i_hash;
+}
+
+/* Let the system start reading the input file NAME, which is to be
+   patched next, while other work goes on.  NAME is only a guess, so
+   ignore any errors.  */
+
+void
+prefetch_input (char *name)
+{
+#if HAVE_POSIX_FADVISE && defined POSIX_FADV_WILLNEED
+  if (! (unsafe || filename_is_safe (name)))
+    return;
+  int fd = safe_open (name, O_RDONLY | O_BINARY | O_NONBLOCK | O_NOCTTY, 0);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode))
+    posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+  close (fd);
+#endif
+}
+
+/* Index the input lines by hash, putting the line numbers in each
+   bucket in increasing order.  */
+
+static void
+index_line_hashes (void)
+{
+  uint_least32_t const *hash = input_line_hashes ();
+  idx_t n = input_lines ();
+  idx_t buckets = 1;
+  while (buckets < n && buckets <= UINT_LEAST32_MAX / 2)
+    buckets *= 2;
+  i_bymask = buckets - 1;
+
+  /* Count the lines in each bucket, make the counts into starts, and
+     put the lines in place.  Each bucket's start then ends up where
+     the next one's should be, so shift the starts back.  */
+  i_bystart = xicalloc (buckets + 1, sizeof *i_bystart);
+  for (idx_t line = 1; line <= n; line++)
+    i_bystart[(hash[line] & i_bymask) + 1]++;
+  for (idx_t b = 0; b < buckets; b++)
+    i_bystart[b + 1] += i_bystart[b];
+  i_byline = xinmalloc (n + 1, sizeof *i_byline);
+  for (idx_t line = 1; line <= n; line++)
+    i_byline[i_bystart[hash[line] & i_bymask]++] = line;
+  for (idx_t b = buckets; 0 < b; b--)
+    i_bystart[b] = i_bystart[b - 1];
+  i_bystart[0] = 0;
+}
+
+/* Return the numbers of the input lines whose hashes might be H, in
+   increasing order, and set *COUNT to how many there are.  Lines with
+   other hashes may be among them.  */
+
+idx_t const *
+input_lines_hashed (uint_least32_t h, idx_t *count)
+{
+  if (! i_bystart)
+    index_line_hashes ();
+  idx_t b = h & i_bymask;
+  *count = i_bystart[b + 1] - i_bystart[b];
+  return i_byline + i_bystart[b];
 }
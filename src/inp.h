@@ -16,14 +16,21 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
 
-/* Number of lines in input file.  */
-extern idx_t input_lines;
-
 /* Description of an input line: a pointer to its start, and the
    number of bytes in it (including any trailing newline).  */
 struct iline { char const *ptr; idx_t size; };
 
-struct iline ifetch (idx_t) ATTRIBUTE_PURE;
+struct iline ifetch (idx_t);
+struct iline input_tail (idx_t);
+void input_sha1 (unsigned char *);
+idx_t copy_input_range (int, char const *, idx_t);
+idx_t input_lines (void);
+bool input_has_lines (idx_t);
+uint_least32_t hash_line (char const *, idx_t) ATTRIBUTE_PURE;
+uint_least32_t input_line_hash (idx_t);
+uint_least32_t const *input_line_hashes (void);
+idx_t const *input_lines_hashed (uint_least32_t, idx_t *);
 bool get_input_file (char *, char const *, mode_t);
+void prefetch_input (char *);
 void re_input (void);
 void scan_input (char *, mode_t, int);
@@ -46,7 +46,7 @@ locate_merge (idx_t *matched)
     idx_t first_guess = pch_first () + in_offset;
     idx_t pat_lines = pch_ptrn_lines ();
     idx_t context_lines = count_context_lines ();
-    idx_t max_where = input_lines - pat_lines + context_lines + 1;
+    idx_t max_where = input_lines () - pat_lines + context_lines + 1;
     idx_t min_where = last_frozen_line + 1;
     ptrdiff_t max_pos_offset = max_where - first_guess;
     ptrdiff_t max_neg_offset = first_guess - min_where;
@@ -89,8 +89,8 @@ locate_merge (idx_t *matched)
 	  {
 	    idx_t guess = first_guess + offset, last, changes;
 
-	    changes = bestmatch (1, pat_lines + 1, guess, input_lines + 1,
-				 match_until_eof ? input_lines - guess + 1 : min,
+	    changes = bestmatch (1, pat_lines + 1, guess, input_lines () + 1,
+				 match_until_eof ? input_lines () - guess + 1 : min,
 				 max, &last);
 	    if (changes <= max && max_matched < last - guess)
 	      {
@@ -106,8 +106,8 @@ locate_merge (idx_t *matched)
 	  {
 	    idx_t guess = first_guess - offset, last, changes;
 
-	    changes = bestmatch (1, pat_lines + 1, guess, input_lines + 1,
-				 match_until_eof ? input_lines - guess + 1 : min,
+	    changes = bestmatch (1, pat_lines + 1, guess, input_lines () + 1,
+				 match_until_eof ? input_lines () - guess + 1 : min,
 				 max, &last);
 	    if (changes <= max && max_matched < last - guess)
 	      {
@@ -176,7 +176,6 @@ merge_hunk (intmax_t hunk, struct outstate *outstate,
   bool applies_cleanly;
   bool first_result = true;
   bool already_applied;
-  FILE *fp = outstate->ofp;
   idx_t old = 1;
   idx_t firstold = pch_ptrn_lines ();
   idx_t new = firstold + 1;
@@ -279,7 +278,7 @@ merge_hunk (intmax_t hunk, struct outstate *outstate,
 	    {
 	      while (firstnew < new)
 		{
-		  outstate->after_newline = pch_write_line (firstnew, fp);
+		  outstate->after_newline = output_pch_line (outstate, firstnew);
 		  firstnew++;
 		}
 	      outstate->zero_output = false;
@@ -426,7 +425,7 @@ merge_hunk (intmax_t hunk, struct outstate *outstate,
 			where, where + lines - 1);
 	  out_offset += lines - (in - firstin);
 
-	  Fputs (&"\n<<<<<<<\n"[outstate->after_newline], fp);
+	  output_string (outstate, &"\n<<<<<<<\n"[outstate->after_newline]);
 	  outstate->after_newline = true;
 	  if (firstin < in)
 	    {
@@ -437,27 +436,25 @@ merge_hunk (intmax_t hunk, struct outstate *outstate,
 
 	  if (conflict_style == MERGE_DIFF3)
 	    {
-	      Fputs (&"\n|||||||\n"[outstate->after_newline], fp);
+	      output_string (outstate, &"\n|||||||\n"[outstate->after_newline]);
 	      outstate->after_newline = true;
 	      while (firstold < old)
 		{
-		  outstate->after_newline = pch_write_line (firstold, fp);
+		  outstate->after_newline = output_pch_line (outstate, firstold);
 		  firstold++;
 		}
 	    }
 
-	  Fputs (&"\n=======\n"[outstate->after_newline], fp);
+	  output_string (outstate, &"\n=======\n"[outstate->after_newline]);
 	  outstate->after_newline = true;
 	  while (firstnew < new)
 	    {
-	      outstate->after_newline = pch_write_line (firstnew, fp);
+	      outstate->after_newline = output_pch_line (outstate, firstnew);
 	      firstnew++;
 	    }
-	  Fputs (&"\n>>>>>>>\n"[outstate->after_newline], fp);
+	  output_string (outstate, &"\n>>>>>>>\n"[outstate->after_newline]);
 	  outstate->after_newline = true;
 	  outstate->zero_output = false;
-	  if (ferror (fp))
-	    write_fatal ();
 
 	  /* Output common suffix lines.  */
 	  if (common_suffix)
@@ -493,6 +490,9 @@ count_context_lines (void)
 static bool
 context_matches_file (idx_t old, idx_t where)
 {
+  if (canonicalize_ws && pch_line_hash (old) != input_line_hash (where))
+    return false;
+
   struct iline line = ifetch (where);
   return line.size &&
 	 (canonicalize_ws ?
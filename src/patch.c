@@ -18,10 +18,14 @@
 
 #include <common.h>
 #include <argmatch.h>
+#include <binary.h>
 #include <closeout.h>
 #include <exitfail.h>
 #include <getopt.h>
+#include <hash.h>
+#include <ignore-value.h>
 #include <inp.h>
+#include <obstack.h>
 #include <pch.h>
 #include <quotearg.h>
 #include <util.h>
@@ -30,6 +34,20 @@
 #include <xstdopen.h>
 #include <safe.h>
 
+#include <sys/uio.h>
+
+#if HAVE_FORK
+# include <poll.h>
+# include <sys/socket.h>
+# include <sys/wait.h>
+# ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+# endif
+#endif
+
+#define obstack_chunk_alloc xmalloc
+#define obstack_chunk_free free
+
 #ifndef __has_feature
 # define __has_feature(a) false
 #endif
@@ -47,6 +65,7 @@ bool canonicalize_ws;
 bool dry_run;
 bool follow_symlinks;
 bool force;
+bool fsync_output;
 bool no_strip_trailing_cr;
 bool noreverse_flag;
 bool posixly_correct;
@@ -68,6 +87,7 @@ idx_t last_frozen_line;
 int binary_transput;
 #endif
 int inerrno;
+intmax_t jobs;
 intmax_t patch_get;
 intmax_t strippath;
 ptrdiff_t in_offset;
@@ -83,11 +103,22 @@ unsigned short int debug;
 /* procedures */
 
 static FILE *create_output_file (struct outfile *, int);
-static idx_t locate_hunk (idx_t);
+static idx_t locate_hunk (idx_t *, idx_t);
+static bool already_applied (void);
 static bool check_line_endings (idx_t);
 static bool apply_hunk (struct outstate *, idx_t);
+static bool splice_hunk (struct outstate *, idx_t);
+static idx_t locate_misordered_hunk (void);
+static ptrdiff_t output_offset (idx_t);
+static void record_hunk (idx_t, ptrdiff_t);
 static bool patch_match (idx_t, idx_t, idx_t, idx_t);
-static bool spew_output (struct outstate *, struct stat *);
+static bool match_lines (idx_t, ptrdiff_t, idx_t, idx_t);
+static void copy_input (struct outstate *, struct iline);
+static void output_directive (struct outstate *, char const *);
+static void flush_output (struct outstate *);
+static void spew_output (struct outstate *, struct stat *);
+static bool ed_script_fits (void);
+static void apply_ed_script (struct outstate *);
 static intmax_t numeric_string (char const *, bool, char const *);
 static void perfile_cleanup_remove (void);
 static void cleanup_remove (void);
@@ -97,17 +128,28 @@ static void init_output (struct outstate *);
 static FILE *open_outfile (char *);
 static void init_reject (char const *);
 static void reinitialize_almost_everything (void);
+static void patch_in_parallel (void);
+static bool next_section (void);
+static bool finish_jobs (void);
+static bool in_job (void);
+static void wait_for_other_jobs (void);
 _Noreturn static void usage (FILE *, int);
 
 static void abort_hunk (char const *, bool, bool);
 static void abort_hunk_context (bool, bool);
 static void abort_hunk_unified (bool, bool);
 
+static bool output_later (void);
 static void output_file (struct outfile *, const struct stat *, char *,
 			 const struct stat *, mode_t, bool);
 
+static void remove_dirs_later (char const *);
 static void delete_files (void);
 static void output_files (struct stat const *, int);
+static void output_file_after_sync (struct outfile *, struct stat const *,
+				    char *, struct stat const *, mode_t, bool);
+static bool waits_for_sync (struct stat const *);
+static bool defer_sync (int, dev_t);
 
 #ifdef ENABLE_MERGE
 static bool merge;
@@ -142,8 +184,37 @@ static struct outfile tmprej = { .temporary = true };
 
 static intmax_t maxfuzz = 2;
 
+/* With --fsync, the number of output files waiting to be synced.  */
+static idx_t nfiles_to_sync;
+
 static char serrbuf[BUFSIZ];
 
+/* The output for a file is built as a list of pieces, each either a
+   span of the input file or text that does not come from it, and is
+   written out when the file is done.  So a hunk can be spliced in
+   before part of the file that is already output, and most of the
+   output is written with a few writev calls.  */
+
+struct outpiece
+{
+  char const *ptr;
+  idx_t size;
+  idx_t line;		/* first input line at or after the piece */
+  bool input;		/* whether the piece is a span of the input */
+};
+
+static struct outpiece *out_piece;	/* pieces of output, in order */
+static idx_t out_pieces;		/* number of pieces */
+static idx_t out_piece_alloc;		/* allocated size of out_piece */
+static idx_t out_sealed;		/* pieces before this are complete */
+static struct obstack out_text;		/* text of pieces not from input */
+static char *out_text_base;		/* bottom of out_text */
+
+/* Where each hunk applied to this file went in the input, and how many
+   lines it added, in order of input line.  */
+static struct { idx_t line; ptrdiff_t delta; } *placed;
+static idx_t nplaced, nplaced_alloc;
+
 /* Apply a set of diffs as appropriate. */
 
 int
@@ -201,7 +272,7 @@ main (int argc, char **argv)
       backup_type = get_version (version_control_context, version_control);
 
     init_output (&outstate);
-    if (outfile)
+    if (outfile && (! dry_run || strEQ (outfile, "-")))
       outstate.ofp = open_outfile (outfile);
 
     /* Make sure we clean up in case of disaster.  */
@@ -223,10 +294,14 @@ main (int argc, char **argv)
 	file_type = S_IFREG;
 	inerrno = -1;
       }
-    for (
-	open_patch_file (patchname);
-	there_is_another_patch (! (inname || posixly_correct), &file_type)
-	  || apply_empty_patch;
+    open_patch_file (patchname);
+    if (1 < jobs && ! (inname || outfile || posixly_correct
+		       || (outrej.name && ! strEQ (outrej.name, "-"))))
+      patch_in_parallel ();
+    for (;
+	next_section ()
+	&& (there_is_another_patch (! (inname || posixly_correct), &file_type)
+	    || apply_empty_patch);
 	reinitialize_almost_everything(),
 	  skip_reject_file = false,
 	  apply_empty_patch = false
@@ -241,11 +316,8 @@ main (int argc, char **argv)
 
       if (have_git_diff != pch_git_diff ())
 	{
-	  if (have_git_diff)
-	    {
-	      output_files (nullptr, 0);
-	      inerrno = -1;
-	    }
+	  output_files (nullptr, 0);
+	  inerrno = -1;
 	  have_git_diff = ! have_git_diff;
 	}
 
@@ -284,6 +356,19 @@ main (int argc, char **argv)
 	    }
 	}
 
+      /* Put in place the output waiting to be synced that replaces
+	 the input file, before patching the file again.  */
+      if (nfiles_to_sync && ! skip_rest_of_patch)
+	{
+	  if (inerrno < 0)
+	    inerrno = stat_file (inname, &instat);
+	  if (! inerrno && waits_for_sync (&instat))
+	    {
+	      output_files (nullptr, 0);
+	      inerrno = -1;
+	    }
+	}
+
       if (pch_git_diff () && ! skip_rest_of_patch)
 	{
 	  struct stat outstat;
@@ -340,11 +425,41 @@ main (int argc, char **argv)
 	    }
 	}
 
+      /* A git diff that only renames or copies a file or changes its
+	 mode need not rewrite the file: have the kernel copy or share
+	 its data, or rename it or change its mode where it is, without
+	 any temporary file.  Rename a file directly only to a name not
+	 in use, and only if nothing else is to be output in its place.  */
+      bool same_contents = (! skip_rest_of_patch && ! outfile && ! dry_run
+			    && pch_git_diff () && pch_no_hunks ()
+			    && ! inerrno && S_ISREG (instat.st_mode)
+			    && S_ISREG (file_type) && ! make_backups
+			    && ! (set_time | set_utc));
+      bool in_place = same_contents && ! pch_copy ();
+      if (in_place && ! strEQ (inname, outname))
+	{
+	  struct stat outst;
+	  in_place = (! has_queued_output (&instat)
+		      && stat_file (outname, &outst) == ENOENT);
+	}
+
+      /* A dry run writes nothing; it only finds where the hunks go.
+	 With -o, the output goes straight to the output file.
+	 Otherwise, write the output to a file without a name if the
+	 system allows, and name it only if it is kept.  Ed needs a
+	 name to write to.  */
       tmpoutst.st_size = -1;
-      int outfd = make_tempfile (&tmpout, 'o', outname,
-				 O_WRONLY | binary_transput,
-				 instat.st_mode & S_IRWXUGO);
-      if (outfd < 0)
+      bool use_tempfile = ! (in_place || dry_run || outfile);
+      int outfd = -1;
+      if (use_tempfile)
+	outfd = (diff_type == ED_DIFF
+		 ? make_tempfile (&tmpout, 'o', outname,
+				  O_WRONLY | binary_transput,
+				  instat.st_mode & S_IRWXUGO)
+		 : make_unnamed_tempfile (&tmpout, 'o', outname,
+					  O_WRONLY | binary_transput,
+					  instat.st_mode & S_IRWXUGO));
+      if (outfd < 0 && use_tempfile)
 	{
 	  /* FIXME: Explain why ELOOP and EXDEV are special here.  */
 	  if (diff_type == ED_DIFF
@@ -363,24 +478,63 @@ main (int argc, char **argv)
       if (diff_type == ED_DIFF) {
 	outstate.zero_output = false;
 	somefailed |= skip_rest_of_patch;
-	do_ed_script (inname, &tmpout, outstate.ofp);
-	if (! dry_run && ! outfile && ! skip_rest_of_patch)
+	bool simple = read_ed_script () && S_ISREG (file_type);
+	if (! dry_run && ! skip_rest_of_patch)
 	  {
-	    if (fstat (outfd, &tmpoutst) != 0)
-	      pfatal ("%s", tmpout.name);
-	    outstate.zero_output = tmpoutst.st_size == 0;
+	    /* Apply simple scripts directly, and leave the rest to ed.  */
+	    if (simple)
+	      {
+		if (instat.st_size != 0)
+		  {
+		    int oflags = (O_RDONLY | binary_transput
+				  | (follow_symlinks ? 0 : O_NOFOLLOW));
+		    ifd = safe_open (inname, oflags, 0);
+		    if (ifd < 0)
+		      pfatal ("Can't open file %s", quotearg (inname));
+		  }
+		scan_input (inname, file_type, ifd);
+		simple = ed_script_fits ();
+	      }
+	    if (simple)
+	      {
+		if (! outfile)
+		  {
+		    outstate.ofp = fdopen (outfd, binary_transput ? "wb" : "w");
+		    if (! outstate.ofp)
+		      pfatal ("%s", tmpout.name);
+		  }
+		else
+		  outstate.after_newline = true;
+		apply_ed_script (&outstate);
+		spew_output (&outstate, &tmpoutst);
+	      }
+	    else if (! outfile)
+	      do_ed_script (inname, &tmpout, outstate.ofp);
+	    else
+	      {
+		/* With -o, have ed write to a temporary file, and copy
+		   that to the output file.  */
+		outfd = make_tempfile (&tmpout, 'o', nullptr,
+				       O_WRONLY | binary_transput, 0600);
+		if (outfd < 0)
+		  pfatal ("Can't create temporary file %s", tmpout.name);
+		do_ed_script (inname, &tmpout, outstate.ofp);
+		if (close (outfd) < 0)
+		  write_fatal ();
+		outfd = -1;
+	      }
+	    if (! outfile)
+	      {
+		if (fstat (outfd, &tmpoutst) != 0)
+		  pfatal ("%s", tmpout.name);
+		outstate.zero_output = tmpoutst.st_size == 0;
+	      }
 	  }
       } else {
 	bool apply_anyway = merge;  /* don't try to reverse when merging */
 
-	if (! skip_rest_of_patch && diff_type == GIT_BINARY_DIFF) {
-	  say ("File %s: git binary diffs are not supported.\n",
-	       quotearg (outname));
-	  skip_rest_of_patch = true;
-	  somefailed = true;
-	}
 	/* initialize the patched file */
-	if (! skip_rest_of_patch && ! outfile)
+	if (! skip_rest_of_patch && use_tempfile)
 	  {
 	    outstate.ofp = fdopen (outfd, binary_transput ? "wb" : "w");
 	    if (! outstate.ofp)
@@ -397,7 +551,7 @@ main (int argc, char **argv)
 
 	/* find out where all the lines are */
 	if (!skip_rest_of_patch) {
-	    if (S_ISREG (file_type) && instat.st_size != 0)
+	    if (S_ISREG (file_type) && instat.st_size != 0 && ! in_place)
 	      {
 		int oflags = (O_RDONLY | binary_transput
 			      | (follow_symlinks ? 0 : O_NOFOLLOW));
@@ -406,7 +560,19 @@ main (int argc, char **argv)
 		  pfatal ("Can't open file %s", quotearg (inname));
 	      }
 
-	    scan_input (inname, file_type, ifd);
+	    if (! same_contents)
+	      scan_input (inname, file_type, ifd);
+	    else
+	      {
+		if (! in_place)
+		  {
+		    if (0 <= ifd)
+		      copy_fd (ifd, outfd);
+		    if (fstat (outfd, &tmpoutst) != 0)
+		      pfatal ("%s", tmpout.name);
+		  }
+		outstate.zero_output = instat.st_size == 0;
+	      }
 
 	    if (verbosity != SILENT)
 	      {
@@ -426,6 +592,13 @@ main (int argc, char **argv)
 	      }
 	}
 
+	if (diff_type == GIT_BINARY_DIFF && ! skip_rest_of_patch
+	    && ! apply_binary_patch (outname, &outstate, &tmpoutst))
+	  {
+	    skip_rest_of_patch = true;
+	    somefailed = true;
+	  }
+
 	/* apply each hunk of patch */
 	while (another_hunk (diff_type, reverse_flag))
 	  {
@@ -433,6 +606,8 @@ main (int argc, char **argv)
 	    idx_t newwhere;
 	    idx_t fuzz = 0;
 	    idx_t mymaxfuzz;
+	    ptrdiff_t ordered_in_offset = in_offset;
+	    bool misordered = false;
 
 	    if (merge)
 	      {
@@ -449,42 +624,68 @@ main (int argc, char **argv)
 
 	    hunk++;
 	    if (!skip_rest_of_patch) {
-		bool incr_fuzz;
-		do {
-		    incr_fuzz = true;
-		    where = locate_hunk(fuzz);
-		    if (! where || fuzz || in_offset)
-		      mismatch = true;
-		    if (hunk == 1 && ! where && ! (force | apply_anyway)
-			&& reverse_flag == reverse_flag_specified) {
+		ptrdiff_t prev_in_offset = in_offset;
+		/* A hunk expected among the lines already output is
+		   misordered; look for it there before looking further on.  */
+		bool behind = (! merge && last_frozen_line
+			       && (pch_first () + in_offset + pch_ptrn_lines ()
+				   <= last_frozen_line + 1));
+		where = behind ? locate_misordered_hunk () : 0;
+		misordered = !!where;
+		if (! where)
+		  {
+		    /* Look no further for a hunk already applied; go
+		       straight to asking whether to reverse the patch.  */
+		    if (hunk == 1 && ! (force | apply_anyway)
+			&& reverse_flag == reverse_flag_specified
+			&& already_applied ())
+		      fuzz = mymaxfuzz + 1;
+		    else
+		      where = locate_hunk (&fuzz, mymaxfuzz);
+		  }
+		if (! where || fuzz || in_offset || misordered)
+		  mismatch = true;
+		if (hunk == 1 && fuzz && ! (force | apply_anyway)
+		    && reverse_flag == reverse_flag_specified) {
 						/* dwim for reversed patch? */
+		    idx_t unreversed_where = where;
+		    idx_t unreversed_fuzz = fuzz;
+		    ptrdiff_t unreversed_in_offset = in_offset;
+		    in_offset = prev_in_offset;
+		    fuzz = 0;
+		    pch_swap ();
+		    /* Try again, with less fuzz than that.  */
+		    where = locate_hunk (&fuzz, unreversed_fuzz - 1);
+		    if (where
+			&& (ok_to_reverse
+			    ("%s patch detected!",
+			     (reverse_flag
+			      ? "Unreversed"
+			      : "Reversed (or previously applied)"))))
+		      reverse_flag = ! reverse_flag;
+		    else
+		      {
+			/* Put it back to normal.  */
 			pch_swap ();
-			/* Try again.  */
-			where = locate_hunk (fuzz);
-			if (where
-			    && (ok_to_reverse
-				("%s patch detected!",
-				 (reverse_flag
-				  ? "Unreversed"
-				  : "Reversed (or previously applied)"))))
-			  reverse_flag = ! reverse_flag;
+			if (where)
+			  {
+			    apply_anyway = true;
+			    where = (skip_rest_of_patch ? 0
+				     : locate_hunk (&fuzz, mymaxfuzz));
+			  }
 			else
 			  {
-			    /* Put it back to normal.  */
-			    pch_swap ();
-			    if (where)
-			      {
-				apply_anyway = true;
-				incr_fuzz = false;
-				where = 0;
-			      }
+			    where = unreversed_where;
+			    fuzz = unreversed_fuzz;
+			    in_offset = unreversed_in_offset;
 			  }
-		    }
-		} while (!skip_rest_of_patch && !where
-			 && (fuzz += incr_fuzz) <= mymaxfuzz);
+		      }
+		}
 	    }
 
-	    newwhere = (where ? where : pch_first()) + out_offset;
+	    newwhere = ((where ? where : pch_first())
+			+ (! merge && 0 < where && where <= last_frozen_line
+			   ? output_offset (where) : out_offset));
 	    if (skip_rest_of_patch
 		|| (merge && ! merge_hunk (hunk, &outstate, where,
 					   &somefailed))
@@ -492,7 +693,9 @@ main (int argc, char **argv)
 		    && ((where == 1 && pch_says_nonexistent (reverse_flag) == 2
 			 && instat.st_size)
 			|| ! where
-			|| ! apply_hunk (&outstate, where))))
+			|| ! (where <= last_frozen_line
+			      ? splice_hunk (&outstate, where)
+			      : apply_hunk (&outstate, where)))))
 	      {
 		if (! skip_reject_file)
 		  abort_hunk (outname, ! failed, reverse_flag);
@@ -517,21 +720,33 @@ main (int argc, char **argv)
 		       &"s"[in_offset == 1]);
 		say (".\n");
 	      }
+
+	    /* A misordered hunk says nothing about where the hunks after
+	       it are likely to be.  */
+	    if (misordered)
+	      in_offset = ordered_in_offset;
 	  }
 
-	if (!skip_rest_of_patch)
+	/* Let the system read the next file to patch while this one is
+	   written out.  */
+	if (! explicit_inname)
 	  {
-	    /* Finish spewing out the new file.  */
-	    if (! spew_output (&outstate, &tmpoutst))
+	    char *next = next_patch_name ();
+	    if (next)
 	      {
-		say ("Skipping patch.\n");
-		skip_rest_of_patch = true;
+		prefetch_input (next);
+		free (next);
 	      }
 	  }
+
+	if (! skip_rest_of_patch && diff_type != GIT_BINARY_DIFF
+	    && ! same_contents)
+	  /* Finish spewing out the new file.  */
+	  spew_output (&outstate, &tmpoutst);
       }
 
       /* and put the output where desired */
-      bool replace_file = false, backup;
+      bool replace_file = false, wait_for_sync = false, backup;
       mode_t mode;
       if (! skip_rest_of_patch && ! outfile) {
 	  backup = make_backups || (backup_if_mismatch && (mismatch | failed));
@@ -567,7 +782,8 @@ main (int argc, char **argv)
 		  bool set_mode = new_mode && old_mode != new_mode;
 
 		  /* Avoid replacing files when nothing has changed.  */
-		  if (failed < hunk || diff_type == ED_DIFF || set_mode
+		  if (failed < hunk || diff_type == ED_DIFF
+		      || diff_type == GIT_BINARY_DIFF || set_mode
 		      || pch_copy () || pch_rename ())
 		    {
 		      enum file_attributes attr = 0;
@@ -595,6 +811,9 @@ main (int argc, char **argv)
 			    attr |= FA_TIMES;
 			}
 
+		      if (0 <= outfd)
+			link_tempfile (&tmpout, outstate.ofp, outfd, &tmpoutst);
+
 		      if (inerrno)
 		        {
 			  if (set_mode)
@@ -603,14 +822,36 @@ main (int argc, char **argv)
 					       nullptr, -1, nullptr,
 					       mode, &new_time);
 			}
-		      else
+		      else if (! in_place)
 			{
-			  attr |= FA_IDS | FA_MODE | FA_XATTRS;
+			  /* Spare a round trip to the file system if the
+			     output has the right mode already.  */
+			  attr |= FA_IDS | FA_XATTRS;
+			  if (tmpoutst.st_size < 0
+			      || (tmpoutst.st_mode ^ mode) & ~S_IFMT)
+			    attr |= FA_MODE;
 			  set_file_attributes (tmpout.name, outfd, attr,
 					       inname, ifd,
 					       &instat, mode, &new_time);
 			}
 
+		      /* With --fsync, output must be on disk before it is
+			 put in place.  Queued output, and output that
+			 replaces an existing file, is synced later along
+			 with other output.  */
+		      if (fsync_output && 0 <= outfd)
+			{
+			  if (outstate.ofp)
+			    Fflush (outstate.ofp);
+			  if (output_later ())
+			    defer_sync (outfd, tmpoutst.st_dev);
+			  else if (! pch_git_diff () && ! inerrno)
+			    wait_for_sync = defer_sync (outfd,
+							tmpoutst.st_dev);
+			  else
+			    sync_file (outfd);
+			}
+
 		      replace_file = true;
 		    }
 		  else if (backup)
@@ -628,6 +869,9 @@ main (int argc, char **argv)
 	    }
       }
 
+      /* Write any output not yet written, while its input is open.  */
+      flush_output (&outstate);
+
       if (0 <= ifd && close (ifd) < 0)
 	read_fatal ();
 
@@ -644,20 +888,44 @@ main (int argc, char **argv)
 
       if (replace_file)
 	{
-	  output_file (&tmpout, &tmpoutst, outname, nullptr, mode, backup);
-	  if (pch_rename ())
-	    output_file (nullptr, nullptr, inname, &instat, mode, backup);
+	  if (in_place)
+	    {
+	      output_file (&(struct outfile) { .name = inname }, &instat,
+			   outname, nullptr, mode, backup);
+
+	      /* Until it is renamed, treat the file as already removed,
+		 and rename it before anything else is written there.  */
+	      if (! strEQ (inname, outname))
+		{
+		  insert_file_id (&instat, DELETE_LATER);
+		  set_queued_output (&instat, true);
+		}
+	    }
+	  else if (wait_for_sync)
+	    output_file_after_sync (&tmpout, &tmpoutst, outname, &instat,
+				    mode, backup);
+	  else
+	    {
+	      output_file (&tmpout, &tmpoutst, outname, nullptr, mode, backup);
+	      if (pch_rename ())
+		output_file (nullptr, nullptr, inname, &instat, mode, backup);
+	    }
 	}
 
       if (diff_type != ED_DIFF) {
 	struct stat rejst;
 
 	if (failed && ! skip_reject_file) {
-	    Fflush (rejfp);
-	    if (fstat (fileno (rejfp), &rejst) < 0)
-	      write_fatal ();
-	    Fclose (rejfp);
-	    rejfp = nullptr;
+	    if (! dry_run)
+	      {
+		Fflush (rejfp);
+		if (fstat (fileno (rejfp), &rejst) < 0)
+		  write_fatal ();
+		if (fsync_output && outname && ! outrej.name)
+		  sync_file (fileno (rejfp));
+		Fclose (rejfp);
+		rejfp = nullptr;
+	      }
 	    somefailed = true;
 	    say ("%jd out of %jd hunk%s %s", failed, hunk, &"s"[hunk == 1],
 		 skip_rest_of_patch ? "ignored" : "FAILED");
@@ -710,14 +978,27 @@ main (int argc, char **argv)
       }
     }
     if (outstate.ofp)
-      Fclose (outstate.ofp);
+      {
+	if (fsync_output)
+	  {
+	    Fflush (outstate.ofp);
+	    sync_file (fileno (outstate.ofp));
+	    if (strcmp (outfile, "-") != 0)
+	      dir_changed (outfile);
+	  }
+	Fclose (outstate.ofp);
+      }
+
+    somefailed |= finish_jobs ();
 
     defer_signals ();
     cleanup_remove ();
     undefer_signals ();
 
     output_files (nullptr, 1);
+    wait_for_other_jobs ();
     delete_files ();
+    sync_dirs ();
     return somefailed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
@@ -729,7 +1010,6 @@ reinitialize_almost_everything (void)
     re_patch();
     re_input();
 
-    input_lines = 0;
     last_frozen_line = 0;
 
     if (inname && ! explicit_inname) {
@@ -739,6 +1019,7 @@ reinitialize_almost_everything (void)
 
     in_offset = 0;
     out_offset = 0;
+    nplaced = 0;
 
     diff_type = NO_DIFF;
 
@@ -751,6 +1032,669 @@ reinitialize_almost_everything (void)
     skip_rest_of_patch = false;
 }
 
+#if HAVE_FORK
+
+/* With --jobs, the patch is first divided into sections, one per file
+   patch.  Sections that name a common file are chained together in
+   patch order, and each chain is patched in order by one job, a child
+   process; independent chains are patched by different jobs at once.
+   Each job's messages go to temporary files, and are output in the
+   order of the sections they belong to, as if patching in order.  */
+
+struct section
+{
+  off_t pos;		/* where the section starts in the patch */
+  idx_t line;		/* line number there */
+  idx_t next;		/* next section in its chain, or -1 */
+  bool done;		/* whether the section has been patched */
+  char *out, *err;	/* its messages, until they are output */
+  idx_t outlen, errlen;
+};
+
+static struct section *sections;
+static idx_t nsections;
+
+/* Where in the patch the sections end.  */
+static off_t sections_end;
+static idx_t sections_endline;
+
+/* A section, as sent by the process that finds the sections; it is
+   followed by the bytes of the section's old, new and index names.  */
+struct section_record
+{
+  off_t pos, end;
+  idx_t line, endline;
+  idx_t namelen[3];
+};
+
+/* The section that last named a file.  */
+struct name_owner
+{
+  idx_t section;
+  char name[];
+};
+
+/* A child process patching sections.  */
+struct job
+{
+  pid_t pid;		/* 0 once the job has exited */
+  int fd;		/* socket to the job */
+  int out, err;		/* temporary files for its standard output and error */
+  idx_t section;	/* section it was last given, or -1 */
+  bool busy;		/* whether it is patching that section */
+};
+
+static struct job *job;
+static idx_t njobs;
+
+/* In a job, the socket to the parent and the section being patched.  */
+static int job_fd = -1;
+static idx_t job_section = -1;
+
+/* Besides section numbers, the commands that the parent sends a job.  */
+enum { JOB_FINISH = -1, JOB_ABORT = -2 };
+
+/* Read SIZE bytes from FD into BUF.  Return false if FD ends first.  */
+
+static bool
+read_fully (int fd, void *buf, idx_t size)
+{
+  char *b = buf;
+  for (idx_t n = 0; n < size; )
+    {
+      idx_t r = Read (fd, b + n, size - n);
+      if (! r)
+	return false;
+      n += r;
+    }
+  return true;
+}
+
+static size_t
+name_owner_hasher (void const *entry, size_t table_size)
+{
+  struct name_owner const *o = entry;
+  return hash_string (o->name, table_size);
+}
+
+static bool
+name_owner_comparator (void const *entry1, void const *entry2)
+{
+  struct name_owner const *o1 = entry1;
+  struct name_owner const *o2 = entry2;
+  return strEQ (o1->name, o2->name);
+}
+
+/* Canonicalize the file name NAME in place, so that sections naming
+   the same file in different ways are chained together: omit empty
+   and "." components.  */
+
+static void
+canonicalize_name (char *name)
+{
+  char const *p = name;
+  char *q = name + (*name == '/');
+  while (*p)
+    {
+      while (*p == '/')
+	p++;
+      char const *component = p;
+      while (*p && *p != '/')
+	p++;
+      idx_t len = p - component;
+      if (! len || (len == 1 && *component == '.'))
+	continue;
+      if (q != name && q[-1] != '/')
+	*q++ = '/';
+      memmove (q, component, len);
+      q += len;
+    }
+  *q = '\0';
+}
+
+/* Return the first section of the chain that section I is in, given
+   the union-find forest CHAIN.  */
+
+static idx_t
+chain_head (idx_t *chain, idx_t i)
+{
+  while (chain[i] != i)
+    i = chain[i] = chain[chain[i]];
+  return i;
+}
+
+/* In a child process, parse the patch from the current position to
+   find its sections, and write a record of each to FD.  Stop at an ed
+   script, which can only be patched in order.  */
+
+_Noreturn static void
+find_sections (int fd)
+{
+  int null = open ("/dev/null", O_WRONLY);
+  if (null < 0 || dup2 (null, STDOUT_FILENO) < 0
+      || dup2 (null, STDERR_FILENO) < 0)
+    _exit (EXIT_TROUBLE);
+  tmppat.exists = nullptr;
+  batch = true;
+  verbosity = SILENT;
+  patch_get = 0;
+
+  for (;;)
+    {
+      struct section_record r;
+      mode_t file_type;
+      r.pos = patch_position (&r.line);
+      if (! there_is_another_patch (true, &file_type)
+	  || diff_type == ED_DIFF)
+	break;
+      while (another_hunk (diff_type, reverse_flag))
+	continue;
+      r.end = patch_position (&r.endline);
+
+      char const *name[3];
+      idx_t size = sizeof r;
+      for (int i = OLD; i <= INDEX; i++)
+	{
+	  name[i] = pch_name (i);
+	  r.namelen[i] = name[i] ? strlen (name[i]) : 0;
+	  size += r.namelen[i];
+	}
+      char *buf = ximalloc (size);
+      char *p = mempcpy (buf, &r, sizeof r);
+      for (int i = OLD; i <= INDEX; i++)
+	p = mempcpy (p, name[i], r.namelen[i]);
+      Write (fd, buf, size);
+      free (buf);
+
+      reinitialize_almost_everything ();
+    }
+  _exit (EXIT_SUCCESS);
+}
+
+/* Divide the rest of the patch into sections, and chain together the
+   sections that name a common file, however its name is spelled.  Store the first section of each
+   chain into *HEADS, and return the number of chains.  If a section
+   cannot be parsed, the sections end before it.  */
+
+static idx_t
+scan_sections (idx_t **heads)
+{
+  int fd[2];
+  if (pipe (fd) < 0)
+    pfatal ("pipe");
+  Fflush (stdout);
+  fflush (stderr);
+  pid_t pid = fork ();
+  if (pid < 0)
+    pfatal ("fork");
+  if (! pid)
+    {
+      close (fd[0]);
+      find_sections (fd[1]);
+    }
+  close (fd[1]);
+
+  Hash_table *owners = hash_initialize (0, nullptr, name_owner_hasher,
+					name_owner_comparator, free);
+  if (! owners)
+    xalloc_die ();
+  idx_t *chain = nullptr;
+  idx_t nalloc = 0;
+  struct section_record r;
+
+  while (read_fully (fd[0], &r, sizeof r))
+    {
+      idx_t i = nsections;
+      if (i == nalloc)
+	{
+	  sections = xpalloc (sections, &nalloc, 1, -1, sizeof *sections);
+	  chain = xireallocarray (chain, nalloc, sizeof *chain);
+	}
+      sections[i] = (struct section) { .pos = r.pos, .line = r.line,
+				       .next = -1 };
+      chain[i] = i;
+
+      bool complete = true;
+      for (int n = OLD; complete && n <= INDEX; n++)
+	if (r.namelen[n])
+	  {
+	    struct name_owner *o
+	      = ximalloc (offsetof (struct name_owner, name)
+			  + r.namelen[n] + 1);
+	    complete = read_fully (fd[0], o->name, r.namelen[n]);
+	    o->name[r.namelen[n]] = '\0';
+	    canonicalize_name (o->name);
+	    o->section = i;
+	    struct name_owner *owner = hash_insert (owners, o);
+	    if (! owner)
+	      xalloc_die ();
+	    if (owner != o)
+	      {
+		/* Join the chains, keeping the earlier section first.  */
+		idx_t h1 = chain_head (chain, owner->section);
+		idx_t h2 = chain_head (chain, i);
+		chain[MAX (h1, h2)] = MIN (h1, h2);
+		free (o);
+	      }
+	  }
+      if (! complete)
+	break;
+      sections_end = r.end;
+      sections_endline = r.endline;
+      nsections++;
+    }
+  close (fd[0]);
+  if (waitpid (pid, nullptr, 0) < 0)
+    pfatal ("waitpid");
+  hash_free (owners);
+
+  /* Link each chain in patch order.  */
+  *heads = xinmalloc (nsections, sizeof **heads);
+  idx_t *tail = xinmalloc (nsections, sizeof *tail);
+  idx_t nheads = 0;
+  for (idx_t i = 0; i < nsections; i++)
+    {
+      idx_t h = chain_head (chain, i);
+      if (h == i)
+	(*heads)[nheads++] = i;
+      else
+	sections[tail[h]].next = i;
+      tail[h] = i;
+    }
+  free (tail);
+  free (chain);
+  return nheads;
+}
+
+/* Send COMMAND to job J.  If J has died, the parent learns of it
+   from J's socket.  */
+
+static void
+send_job (idx_t j, idx_t command)
+{
+  ignore_value (send (job[j].fd, &command, sizeof command, MSG_NOSIGNAL));
+}
+
+/* Read the messages that have accumulated in the temporary file FD,
+   and empty it.  Store their length into *LEN.  */
+
+static char *
+read_messages (int fd, idx_t *len)
+{
+  off_t size = lseek (fd, 0, SEEK_END);
+  if (size < 0 || lseek (fd, 0, SEEK_SET) < 0)
+    read_fatal ();
+  char *buf = nullptr;
+  *len = 0;
+  if (size)
+    {
+      if (IDX_MAX < size)
+	xalloc_die ();
+      buf = ximalloc (size);
+      if (! read_fully (fd, buf, size))
+	read_fatal ();
+      if (ftruncate (fd, 0) < 0)
+	write_fatal ();
+      *len = size;
+    }
+  return buf;
+}
+
+/* Collect the messages of job J into S.  */
+
+static void
+collect_messages (idx_t j, struct section *s)
+{
+  s->out = read_messages (job[j].out, &s->outlen);
+  s->err = read_messages (job[j].err, &s->errlen);
+}
+
+/* Output S's messages and free them.  */
+
+static void
+output_messages (struct section *s)
+{
+  if (s->outlen)
+    {
+      Fwrite (s->out, 1, s->outlen, stdout);
+      Fflush (stdout);
+    }
+  if (s->errlen)
+    {
+      Fwrite (s->err, 1, s->errlen, stderr);
+      Fflush (stderr);
+    }
+  free (s->out);
+  free (s->err);
+  s->out = s->err = nullptr;
+}
+
+/* Return a temporary file for a job's messages.  */
+
+static int
+make_message_file (void)
+{
+  struct outfile tmp = { .temporary = true };
+  int fd = make_tempfile (&tmp, 'j', nullptr, O_RDWR | O_APPEND, 0600);
+  if (fd < 0)
+    pfatal ("Can't create temporary file %s", tmp.name);
+  if (unlink (tmp.name) < 0)
+    pfatal ("Can't remove temporary file %s", tmp.name);
+  free (tmp.alloc);
+  return fd;
+}
+
+/* Start up to 'jobs' jobs, and give them the sections of the rest of
+   the patch.  Return in each job, which then patches the sections
+   that next_section gives it.  Return in the parent once all the
+   sections have been patched, leaving the patch positioned after
+   them.  If the patch is not worth dividing, just return.  */
+
+static void
+patch_in_parallel (void)
+{
+  idx_t *heads;
+  idx_t nheads = scan_sections (&heads);
+  if (nheads < 2)
+    {
+      free (heads);
+      free (sections);
+      sections = nullptr;
+      nsections = 0;
+      return;
+    }
+
+  njobs = MIN (jobs, nheads);
+  job = xinmalloc (njobs, sizeof *job);
+  for (idx_t j = 0; j < njobs; j++)
+    {
+      int sv[2];
+      if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+	pfatal ("socketpair");
+      int out = make_message_file ();
+      int err = make_message_file ();
+      Fflush (stdout);
+      fflush (stderr);
+      pid_t pid = fork ();
+      if (pid < 0)
+	pfatal ("fork");
+      if (! pid)
+	{
+	  for (idx_t k = 0; k < j; k++)
+	    {
+	      close (job[k].fd);
+	      close (job[k].out);
+	      close (job[k].err);
+	    }
+	  free (job);
+	  job = nullptr;
+	  njobs = 0;
+	  free (heads);
+	  close (sv[0]);
+	  tmppat.exists = nullptr;
+	  if (dup2 (out, STDOUT_FILENO) < 0 || dup2 (err, STDERR_FILENO) < 0)
+	    pfatal ("dup2");
+	  close (out);
+	  close (err);
+	  job_fd = sv[1];
+	  return;
+	}
+      close (sv[1]);
+      job[j] = (struct job) { .pid = pid, .fd = sv[0], .out = out,
+			      .err = err, .section = -1 };
+    }
+
+  struct pollfd *pfd = xinmalloc (njobs, sizeof *pfd);
+  idx_t *polled = xinmalloc (njobs, sizeof *polled);
+  idx_t next_head = 0;
+  idx_t printed = 0;
+
+  /* Once a job dies, as it does on a fatal error, begin only the
+     sections before the one it died in, like patching in order would.
+     Jobs still finish the sections after it that they have begun.  */
+  idx_t fatal_section = nsections;
+
+  for (;;)
+    {
+      /* Give each idle job the next section of its chain, or else the
+	 first section of a chain not yet begun, and wait for the busy
+	 jobs.  */
+      idx_t npolled = 0;
+      for (idx_t j = 0; j < njobs; j++)
+	{
+	  if (! job[j].pid)
+	    continue;
+	  if (! job[j].busy)
+	    {
+	      idx_t s = job[j].section < 0 ? -1 : sections[job[j].section].next;
+	      if (s < 0 || fatal_section <= s)
+		s = next_head < nheads ? heads[next_head++] : -1;
+	      if (0 <= s && s < fatal_section)
+		{
+		  send_job (j, s);
+		  job[j].section = s;
+		  job[j].busy = true;
+		}
+	      else
+		job[j].section = -1;
+	    }
+	  if (job[j].busy)
+	    {
+	      pfd[npolled] = (struct pollfd) { .fd = job[j].fd,
+					       .events = POLLIN };
+	      polled[npolled++] = j;
+	    }
+	}
+      if (! npolled)
+	break;
+
+      if (poll (pfd, npolled, -1) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  pfatal ("poll");
+	}
+
+      for (idx_t k = 0; k < npolled; k++)
+	if (pfd[k].revents)
+	  {
+	    idx_t j = polled[k];
+	    struct section *s = &sections[job[j].section];
+	    char c;
+	    ssize_t r = recv (job[j].fd, &c, 1, 0);
+	    if (r <= 0)
+	      {
+		/* The job died patching S.  */
+		if (waitpid (job[j].pid, nullptr, 0) < 0)
+		  pfatal ("waitpid");
+		job[j].pid = 0;
+		close (job[j].fd);
+		fatal_section = MIN (fatal_section, job[j].section);
+	      }
+	    collect_messages (j, s);
+	    s->done = true;
+	    job[j].busy = false;
+	    if (! job[j].pid)
+	      {
+		close (job[j].out);
+		close (job[j].err);
+	      }
+	  }
+
+      for (; printed < nsections && printed <= fatal_section
+	     && sections[printed].done;
+	   printed++)
+	output_messages (&sections[printed]);
+    }
+
+  free (polled);
+  free (pfd);
+  free (heads);
+
+  if (fatal_section < nsections)
+    {
+      /* Report the sections after the fatal error that were patched
+	 anyway, so that no file is changed without a word.  */
+      for (; printed < nsections; printed++)
+	if (sections[printed].done)
+	  output_messages (&sections[printed]);
+
+      for (idx_t j = 0; j < njobs; j++)
+	if (job[j].pid)
+	  {
+	    send_job (j, JOB_ABORT);
+	    waitpid (job[j].pid, nullptr, 0);
+	    job[j].pid = 0;
+	  }
+      fatal_exit ();
+    }
+
+  set_patch_position (sections_end, sections_endline);
+}
+
+/* In a job, wait for the parent to give it the next section to patch,
+   and position the patch there.  Return false if there are no more.  */
+
+static bool
+next_section (void)
+{
+  if (job_fd < 0)
+    return true;
+
+  if (0 <= job_section)
+    {
+      /* Report that the section is done, once its messages are out.  */
+      char c = 0;
+      Fflush (stdout);
+      fflush (stderr);
+      ignore_value (send (job_fd, &c, 1, MSG_NOSIGNAL));
+    }
+
+  idx_t command;
+  if (! read_fully (job_fd, &command, sizeof command)
+      || command == JOB_ABORT)
+    fatal_exit ();
+  if (command == JOB_FINISH)
+    return false;
+  job_section = command;
+  set_patch_position (sections[command].pos, sections[command].line);
+  return true;
+}
+
+/* Let the jobs finish, outputting the files whose output they deferred
+   and then removing the files they were to remove, and output their
+   last messages.  The jobs do this all at once, as their files are
+   unrelated, but none removes files until all have output theirs; see
+   wait_for_other_jobs.  Return true if any of them failed to apply
+   a hunk.  */
+
+static bool
+finish_jobs (void)
+{
+  bool failed = false;
+  bool trouble = false;
+
+  for (idx_t j = 0; j < njobs; j++)
+    if (job[j].pid)
+      send_job (j, JOB_FINISH);
+
+  /* Only once every job has output its files, let them all remove
+     theirs.  A job that dies instead removes no files.  */
+  for (idx_t j = 0; j < njobs; j++)
+    if (job[j].pid)
+      {
+	char c;
+	ignore_value (recv (job[j].fd, &c, 1, 0));
+      }
+  for (idx_t j = 0; j < njobs; j++)
+    if (job[j].pid)
+      send_job (j, JOB_FINISH);
+
+  for (idx_t j = 0; j < njobs; j++)
+    if (job[j].pid)
+      {
+	int status;
+	if (waitpid (job[j].pid, &status, 0) < 0)
+	  pfatal ("waitpid");
+	job[j].pid = 0;
+	struct section s;
+	collect_messages (j, &s);
+	output_messages (&s);
+	close (job[j].fd);
+	close (job[j].out);
+	close (job[j].err);
+	if (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_FAILURE)
+	  failed = true;
+	else if (! (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS))
+	  trouble = true;
+      }
+
+  free (job);
+  job = nullptr;
+  njobs = 0;
+  if (trouble)
+    fatal_exit ();
+  return failed;
+}
+
+/* Is this process a job?  */
+
+static bool
+in_job (void)
+{
+  return 0 <= job_fd;
+}
+
+/* In a job that has output the files whose output it deferred, wait
+   until all jobs have, before removing any files.  Removing a file
+   can remove its directory, where another job may be putting one.  */
+
+static void
+wait_for_other_jobs (void)
+{
+  if (job_fd < 0)
+    return;
+
+  char c = 0;
+  ignore_value (send (job_fd, &c, 1, MSG_NOSIGNAL));
+  idx_t command;
+  if (! read_fully (job_fd, &command, sizeof command)
+      || command == JOB_ABORT)
+    fatal_exit ();
+}
+
+#else
+
+static void
+patch_in_parallel (void)
+{
+}
+
+static bool
+next_section (void)
+{
+  return true;
+}
+
+static bool
+finish_jobs (void)
+{
+  return false;
+}
+
+static bool
+in_job (void)
+{
+  return false;
+}
+
+static void
+wait_for_other_jobs (void)
+{
+}
+
+#endif
+
 static char const shortopts[] = "bB:cd:D:eEfF:g:i:l"
 #if 0 && defined ENABLE_MERGE
 				"m"
@@ -802,6 +1746,8 @@ static struct option const longopts[] =
   {"reject-format", required_argument, nullptr, CHAR_MAX + 9},
   {"read-only", required_argument, nullptr, CHAR_MAX + 10},
   {"follow-symlinks", no_argument, nullptr, CHAR_MAX + 11},
+  {"jobs", required_argument, nullptr, CHAR_MAX + 12},
+  {"fsync", no_argument, nullptr, CHAR_MAX + 13},
   {nullptr, no_argument, nullptr, 0}
 };
 
@@ -863,6 +1809,8 @@ static char const *const option_help[] =
 "  --verbose  Output extra information about the work being done.",
 "  --dry-run  Do not actually change any files; just print what would happen.",
 "  --posix  Conform to the POSIX standard.",
+"  --jobs=NUM  Patch up to NUM independent files at once.",
+"  --fsync  Make sure that the patched files are on disk before exiting.",
 "",
 "  -d DIR  --directory=DIR  Change the working directory to DIR first.",
 "  --reject-format=FORMAT  Create 'context' or 'unified' rejects.",
@@ -1097,6 +2045,12 @@ get_some_switches (int argc, char **argv)
 	    case CHAR_MAX + 11:
 		follow_symlinks = true;
 		break;
+	    case CHAR_MAX + 12:
+		jobs = numeric_string (optarg, false, "number of jobs");
+		break;
+	    case CHAR_MAX + 13:
+		fsync_output = true;
+		break;
 	    default:
 		usage (stderr, EXIT_TROUBLE);
 	}
@@ -1151,24 +2105,145 @@ numeric_string (char const *string,
   return !overflow ? value : negative ? INTMAX_MIN : INTMAX_MAX;
 }
 
-/* Attempt to find the right place to apply this hunk of patch. */
+/* Number of offsets that locate_hunk tries one by one before it
+   switches to comparing hashes of lines first.  */
+enum { LOCATE_HASHED_AFTER = 1024 };
+
+/* Multiplier for hashing a sequence of line hashes.  */
+static uint_fast64_t const LINES_HASH_MULTIPLIER = 0x100000001b3;
+
+/* Return the hash of the K line hashes starting at HASH[POS], weighing
+   each one more than the next if FORWARD, and less otherwise.  Either
+   way, adding a hash at one end and removing one from the other end
+   takes constant time: see slide_lines_hash.  */
+
+static uint_fast64_t
+lines_hash (uint_least32_t const *hash, idx_t pos, idx_t k, bool forward)
+{
+  uint_fast64_t h = 0;
+  for (idx_t j = 0; j < k; j++)
+    h = h * LINES_HASH_MULTIPLIER + hash[forward ? pos + j : pos + k - 1 - j];
+  return h;
+}
+
+/* Return the hash H of K line hashes, with line hash DROP removed from
+   its heaviest end and ADD put at its lightest end.  BK is the
+   multiplier to the power K - 1.  */
+
+static uint_fast64_t
+slide_lines_hash (uint_fast64_t h, uint_fast64_t bk,
+		  uint_least32_t drop, uint_least32_t add)
+{
+  return (h - drop * bk) * LINES_HASH_MULTIPLIER + add;
+}
+
+/* Find the least input line number at least POS, or the greatest at
+   most POS if ! FORWARD, at which lines whose line J has hash H can
+   start.  Store it into *WIN and return true, or return false if there
+   is none.  HASH holds the input line hashes.  */
+
+static bool
+next_window (uint_least32_t const *hash, uint_least32_t h, idx_t j,
+	     idx_t pos, bool forward, idx_t *win)
+{
+  idx_t count;
+  idx_t const *line = input_lines_hashed (h, &count);
+
+  /* Find the first line that is at or after line J of lines at POS.  */
+  idx_t lo = 0, hi = count;
+  while (lo < hi)
+    {
+      idx_t mid = lo + (hi - lo) / 2;
+      if (line[mid] < pos + j)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (forward)
+    {
+      for (; lo < count; lo++)
+	if (hash[line[lo]] == h)
+	  {
+	    *win = line[lo] - j;
+	    return true;
+	  }
+    }
+  else
+    for (idx_t i = lo < count && line[lo] == pos + j ? lo : lo - 1;
+	 0 <= i; i--)
+      if (hash[line[i]] == h)
+	{
+	  *win = line[i] - j;
+	  return true;
+	}
+  return false;
+}
+
+/* Return the least offset that locate_hunk should try for a hunk that
+   it expects at FIRST_GUESS and whose last pattern line that must
+   match is PAT_END lines later.  */
+
+static ptrdiff_t
+min_hunk_offset (idx_t first_guess, idx_t pat_end, ptrdiff_t max_neg_offset)
+{
+  return (! input_has_lines (first_guess + pat_end)
+	  ? first_guess - (input_lines () - pat_end)
+	  : max_neg_offset < 0 ? first_guess - (last_frozen_line + 1)
+	  : 0);
+}
+
+/* Has this git diff been applied to the input file already, judging by
+   the checksums in its index line?  Check only if the first hunk is not
+   where the patch says; otherwise it is cheaper to apply the patch than
+   to read all of the input.  Ignore checksums abbreviated too far to
+   tell files apart.  */
+
+static bool
+already_applied (void)
+{
+  char const *old_sha1 = pch_sha1 (reverse_flag);
+  char const *new_sha1 = pch_sha1 (! reverse_flag);
+  idx_t first = pch_first () + in_offset;
+  idx_t pat_lines = pch_ptrn_lines ();
+
+  if (! (old_sha1 && new_sha1 && ! strEQ (old_sha1, new_sha1)
+	 && SHA1_ABBREV_MIN <= strlen (old_sha1)
+	 && SHA1_ABBREV_MIN <= strlen (new_sha1)
+	 && pch_says_nonexistent (reverse_flag) != 2
+	 && pch_says_nonexistent (! reverse_flag) != 2
+	 && pat_lines)
+      || (input_has_lines (first + pat_lines - 1)
+	  && patch_match (first, 0, 0, 0)))
+    return false;
+
+  unsigned char sum[SHA1_DIGEST_SIZE];
+  input_sha1 (sum);
+  return (sha1_hex_matches (sum, new_sha1, SHA1_ABBREV_MIN)
+	  && ! sha1_hex_matches (sum, old_sha1, SHA1_ABBREV_MIN));
+}
+
+/* Attempt to find the right place to apply this hunk of patch, with as
+   little fuzz as possible from *FUZZ through MAXFUZZ.  Set *FUZZ to the
+   fuzz needed, or to MAXFUZZ + 1 if the hunk cannot be placed.
+
+   With a given fuzz, the search tries offsets 0, 1, -1, 2, -2, ... from
+   where the patch says the hunk goes, and the first one that matches
+   wins.  Rather than repeating that search for each fuzz factor, make
+   one pass over the offsets: find how much fuzz each one needs, and
+   remember the first one that needs less than any before it.  */
 
 static idx_t
-locate_hunk (idx_t fuzz)
+locate_hunk (idx_t *fuzzp, idx_t maxfuzz)
 {
     idx_t first_guess = pch_first () + in_offset;
     idx_t pat_lines = pch_ptrn_lines ();
     idx_t prefix_context = pch_prefix_context ();
     idx_t suffix_context = pch_suffix_context ();
     idx_t context = MAX (prefix_context, suffix_context);
-    ptrdiff_t prefix_fuzz = fuzz + prefix_context - context;
-    ptrdiff_t suffix_fuzz = fuzz + suffix_context - context;
-    idx_t max_where = input_lines - (pat_lines - suffix_fuzz) + 1;
     idx_t min_where = last_frozen_line + 1;
-    ptrdiff_t max_pos_offset = max_where - first_guess;
     ptrdiff_t max_neg_offset = first_guess - min_where;
-    ptrdiff_t max_offset = MAX (max_pos_offset, max_neg_offset);
-    ptrdiff_t min_offset;
+    idx_t fuzz = *fuzzp;
 
     if (!pat_lines)			/* null range matches always */
 	return first_guess;
@@ -1177,65 +2252,259 @@ locate_hunk (idx_t fuzz)
     if (first_guess <= max_neg_offset)
 	max_neg_offset = first_guess - 1;
 
-    if (prefix_fuzz < 0 && pch_first () <= 1)
-      {
-	/* Can only match start of file.  */
+    /* With little fuzz, a hunk with less context at one end than at
+       the other can match only at that end of the file.  */
+    for (; fuzz <= maxfuzz; fuzz++) {
+	ptrdiff_t prefix_fuzz = fuzz + prefix_context - context;
+	ptrdiff_t suffix_fuzz = fuzz + suffix_context - context;
+	ptrdiff_t offset;
+
+	if (prefix_fuzz < 0 && pch_first () <= 1)
+	  {
+	    /* Can only match start of file.  */
+
+	    if (suffix_fuzz < 0)
+	      /* Can only match entire file.  */
+	      if (pat_lines != input_lines ()
+		  || prefix_context < last_frozen_line)
+		continue;
+
+	    offset = 1 - first_guess;
+	    if (! (last_frozen_line <= prefix_context
+		   && input_has_lines (pat_lines - suffix_fuzz)
+		   && patch_match (first_guess, offset, 0, suffix_fuzz)))
+	      continue;
+	  }
+	else if (suffix_fuzz < 0)
+	  {
+	    /* Can only match end of file.  */
+	    offset = first_guess - (input_lines () - pat_lines + 1);
+	    if (! (offset <= max_neg_offset
+		   && patch_match (first_guess, -offset,
+				   MAX (0, prefix_fuzz), 0)))
+	      continue;
+	    offset = -offset;
+	  }
+	else
+	  break;
+
+	*fuzzp = fuzz;
+	in_offset += offset;
+	return first_guess + offset;
+    }
+
+    *fuzzp = fuzz;
+    if (maxfuzz < fuzz)
+      return 0;
+
+    /* The fuzz needed by the best place found so far, and the most
+       fuzz that could still do better.  */
+    idx_t best_fuzz = maxfuzz + 1;
+    ptrdiff_t best_offset = 0;
+    idx_t top = maxfuzz;
+
+    /* The least offset to try is the least for any fuzz factor.  */
+    ptrdiff_t offset = PTRDIFF_MAX;
+    for (idx_t f = fuzz; f <= top; f++) {
+	idx_t pat_end = pat_lines - (f + suffix_context - context) - 1;
+	offset = MIN (offset,
+		      min_hunk_offset (first_guess, pat_end, max_neg_offset));
+    }
+    ptrdiff_t start_offset = offset;
+
+    /* State for comparing line hashes: the pattern lines that must
+       match with fuzz HASHED_TOP, the input line under the first of
+       them at offset 0, and the hashes of those lines and of the input
+       lines there at the last place each way that was looked at.  */
+    uint_least32_t const *hash = nullptr;
+    idx_t n = 0, hashed_top = -1, pfirst = 0, k = 0;
+    uint_least32_t rare_hash = 0;
+    idx_t rare_j = 0;
+    uint_fast64_t bk = 0, pat_fwd = 0, pat_bwd = 0, fwd = 0, bwd = 0;
+    idx_t fwd_pos = 0, bwd_pos = 0;
+
+    for (;; offset++) {
+	idx_t top_pat_end = pat_lines - (top + suffix_context - context) - 1;
+
+	if (offset - start_offset == LOCATE_HASHED_AFTER) {
+	    /* The hunk has drifted far if it is anywhere, so compare line
+	       hashes first from now on.  */
+	    hash = input_line_hashes ();
+	    n = input_lines ();
+	}
+
+	if (hash && hashed_top != top) {
+	    idx_t top_prefix_fuzz = MAX (0, top + prefix_context - context);
+	    hashed_top = top;
+	    pfirst = first_guess + top_prefix_fuzz;
+	    k = top_pat_end + 1 - top_prefix_fuzz;
+	    bk = 1;
+	    pat_fwd = pat_bwd = 0;
+	    idx_t rare_count = IDX_MAX;
+	    for (idx_t j = 0; j < k; j++) {
+		uint_least32_t h = pch_line_hash (1 + top_prefix_fuzz + j);
+		pat_fwd = pat_fwd * LINES_HASH_MULTIPLIER + h;
+		pat_bwd += h * bk;
+		if (j < k - 1)
+		  bk *= LINES_HASH_MULTIPLIER;
+
+		/* Remember the line that is least common in the input.  */
+		idx_t count;
+		input_lines_hashed (h, &count);
+		if (count < rare_count) {
+		    rare_count = count;
+		    rare_hash = h;
+		    rare_j = j;
+		}
+	    }
+	    fwd_pos = bwd_pos = 0;
+	}
 
-	if (suffix_fuzz < 0)
-	  /* Can only match entire file.  */
-	  if (pat_lines != input_lines || prefix_context < last_frozen_line)
-	    return 0;
+	/* Move on quickly past places where the line hashes do not agree
+	   either way.  A window that has run off the end of the file
+	   cannot match; stop at one that has run off the start, and leave
+	   it to the checks below.  */
+	if (hash && 0 < k)
+	  for (;; offset++) {
+	      /* Jump to the next place either way where the least common
+		 line falls on a line like it, or where this loop would
+		 stop for another reason.  Jumping short is harmless.  */
+	      {
+		idx_t fpos = pfirst + offset, bpos = pfirst - offset, win;
+		bool back = offset <= max_neg_offset;
+		if (! ((fpos < 1 && fpos + k - 1 <= n)
+		       || (back && ! (1 <= bpos && bpos + k - 1 <= n)))) {
+		    ptrdiff_t next = MAX (max_neg_offset + 1, n - k + 2 - pfirst);
+		    if (back && pfirst <= max_neg_offset)
+		      next = MIN (next, pfirst);
+		    if (next_window (hash, rare_hash, rare_j, fpos, true, &win))
+		      next = MIN (next, win - pfirst);
+		    if (back
+			&& next_window (hash, rare_hash, rare_j, bpos, false,
+					&win))
+		      next = MIN (next, pfirst - win);
+		    offset = MAX (offset, next);
+		}
+	      }
 
-	ptrdiff_t offset = 1 - first_guess;
-	if (last_frozen_line <= prefix_context
-	    && offset <= max_pos_offset
-	    && patch_match (first_guess, offset, 0, suffix_fuzz))
-	  {
-	    in_offset += offset;
-	    return first_guess + offset;
+	      idx_t pos = pfirst + offset;
+	      bool fits = pos + k - 1 <= n;
+	      if (fits) {
+		  if (pos < 1)
+		    break;
+		  fwd = (fwd_pos == pos ? fwd
+			 : fwd_pos && fwd_pos == pos - 1
+			 ? slide_lines_hash (fwd, bk, hash[pos - 1],
+					     hash[pos + k - 1])
+			 : lines_hash (hash, pos, k, true));
+		  fwd_pos = pos;
+		  if (fwd == pat_fwd)
+		    break;
+	      }
+	      if (offset <= max_neg_offset) {
+		  pos = pfirst - offset;
+		  if (! (1 <= pos && pos + k - 1 <= n))
+		    break;
+		  bwd = (bwd_pos == pos ? bwd
+			 : bwd_pos && bwd_pos == pos + 1
+			 ? slide_lines_hash (bwd, bk, hash[pos + k], hash[pos])
+			 : lines_hash (hash, pos, k, false));
+		  bwd_pos = pos;
+		  if (bwd == pat_bwd)
+		    break;
+	      }
+	      else if (! fits)
+		break;
 	  }
-	else
-	  return 0;
-      }
-    else if (prefix_fuzz < 0)
-      prefix_fuzz = 0;
 
-    if (suffix_fuzz < 0)
-      {
-	/* Can only match end of file.  */
-	ptrdiff_t offset = first_guess - (input_lines - pat_lines + 1);
-	if (offset <= max_neg_offset
-	    && patch_match (first_guess, -offset, prefix_fuzz, 0))
-	  {
-	    in_offset -= offset;
-	    return first_guess - offset;
-	  }
-	else
-	  return 0;
-      }
+	/* Positive offsets are limited by end of file, which is looked
+	   for only as far as needed.  */
+	if (! input_has_lines (first_guess + offset + top_pat_end)
+	    && max_neg_offset < offset)
+	  break;
 
-    min_offset = max_pos_offset < 0 ? first_guess - max_where
-	       : max_neg_offset < 0 ? first_guess - min_where
-	       : 0;
-    for (ptrdiff_t offset = min_offset; offset <= max_offset; offset++) {
-	if (offset <= max_pos_offset
-	    && patch_match (first_guess, offset, prefix_fuzz, suffix_fuzz)) {
-	    if (debug & 1)
-	      say ("Offset changing from %td to %td\n",
-		   in_offset, in_offset + offset);
-	    in_offset += offset;
-	    return first_guess+offset;
-	}
-	if (offset <= max_neg_offset
-	    && patch_match (first_guess, -offset, prefix_fuzz, suffix_fuzz)) {
-	    if (debug & 1)
-	      say ("Offset changing from %td to %td\n",
-		   in_offset, in_offset - offset);
-	    in_offset -= offset;
-	    return first_guess-offset;
+	for (int sign = 1; -1 <= sign; sign -= 2) {
+	    ptrdiff_t o = sign * offset;
+	    idx_t top_prefix_fuzz = MAX (0, top + prefix_context - context);
+	    idx_t top_suffix_fuzz = top + suffix_context - context;
+
+	    /* Skip this place if the line hashes do not agree.  The hashes
+	       are of the lines that must match with fuzz HASHED_TOP, which
+	       is no less than TOP.  */
+	    idx_t pos = pfirst + o;
+	    if (hash && 0 < k && 1 <= pos && pos + k - 1 <= n) {
+		if (0 < sign) {
+		    fwd = (fwd_pos == pos ? fwd
+			   : fwd_pos && fwd_pos == pos - 1
+			   ? slide_lines_hash (fwd, bk, hash[pos - 1],
+					       hash[pos + k - 1])
+			   : lines_hash (hash, pos, k, true));
+		    fwd_pos = pos;
+		    if (fwd != pat_fwd)
+		      continue;
+		}
+		else {
+		    bwd = (bwd_pos == pos ? bwd
+			   : bwd_pos && bwd_pos == pos + 1
+			   ? slide_lines_hash (bwd, bk, hash[pos + k], hash[pos])
+			   : lines_hash (hash, pos, k, false));
+		    bwd_pos = pos;
+		    if (bwd != pat_bwd)
+		      continue;
+		}
+	    }
+
+	    if (! patch_match (first_guess, o, top_prefix_fuzz,
+			       top_suffix_fuzz))
+	      continue;
+
+	    /* The lines that must match with fuzz TOP do.  Match more lines
+	       to see how much less fuzz will do, and find the least fuzz
+	       with which this offset is to be tried at all.  */
+	    idx_t g = -1;
+	    for (idx_t f = top; ; f--) {
+		idx_t prefix_fuzz = MAX (0, f + prefix_context - context);
+		idx_t suffix_fuzz = f + suffix_context - context;
+		idx_t pat_end = pat_lines - suffix_fuzz - 1;
+		if (min_hunk_offset (first_guess, pat_end, max_neg_offset)
+		      <= offset
+		    && (0 < sign
+			? input_has_lines (first_guess + offset + pat_end)
+			: offset <= max_neg_offset))
+		  g = f;
+		if (f == fuzz)
+		  break;
+		idx_t next_prefix_fuzz = MAX (0, f - 1 + prefix_context - context);
+		idx_t next_pat_lines = pat_lines - suffix_fuzz + 1;
+		if (! (match_lines (first_guess, o, 1 + next_prefix_fuzz,
+				    prefix_fuzz)
+		       && match_lines (first_guess, o, next_pat_lines,
+				       next_pat_lines)))
+		  break;
+	    }
+	    if (g < 0)
+	      continue;
+
+	    best_fuzz = g;
+	    best_offset = o;
+	    if (g == fuzz)
+	      goto found;
+	    top = g - 1;
 	}
     }
-    return 0;
+
+    if (maxfuzz < best_fuzz) {
+	*fuzzp = maxfuzz + 1;
+	return 0;
+    }
+
+ found:
+    if (debug & 1)
+      say ("Offset changing from %td to %td\n",
+	   in_offset, in_offset + best_offset);
+    *fuzzp = best_fuzz;
+    in_offset += best_offset;
+    return first_guess + best_offset;
 }
 
 static void
@@ -1399,6 +2668,10 @@ abort_hunk_context (bool header, bool reverse)
 static void
 abort_hunk (char const *outname, bool header, bool reverse)
 {
+  /* A dry run saves no rejects.  */
+  if (dry_run)
+    return;
+
   if (!tmprej.exists)
     init_reject (outname);
   if (reject_format == UNI_DIFF
@@ -1419,7 +2692,7 @@ apply_hunk (struct outstate *outstate, idx_t where)
     enum {OUTSIDE, IN_IFNDEF, IN_IFDEF, IN_ELSE} def_state = OUTSIDE;
     char const *R_do_defines = do_defines;
     idx_t pat_end = pch_end ();
-    FILE *fp = outstate->ofp;
+    ptrdiff_t delta = pch_repl_lines () - pch_ptrn_lines ();
 
     where--;
     while (pch_char(new) == '=' || pch_char(new) == '\n')
@@ -1432,17 +2705,16 @@ apply_hunk (struct outstate *outstate, idx_t where)
 		return false;
 	    if (R_do_defines) {
 		if (def_state == OUTSIDE) {
-		    putline (fp, outstate->after_newline + not_defined,
-			     R_do_defines, nullptr);
+		    output_directive (outstate,
+				      outstate->after_newline + not_defined);
 		    def_state = IN_IFNDEF;
 		}
 		else if (def_state == IN_IFDEF) {
-		    Fputs (outstate->after_newline + else_defined, fp);
+		    output_string (outstate,
+				   outstate->after_newline + else_defined);
 		    def_state = IN_ELSE;
 		}
-		if (ferror (fp))
-		  write_fatal ();
-		outstate->after_newline = pch_write_line (old, fp);
+		outstate->after_newline = output_pch_line (outstate, old);
 		outstate->zero_output = false;
 	    }
 	    last_frozen_line++;
@@ -1456,18 +2728,17 @@ apply_hunk (struct outstate *outstate, idx_t where)
 		return false;
 	    if (R_do_defines) {
 		if (def_state == IN_IFNDEF) {
-		    Fputs (outstate->after_newline + else_defined, fp);
+		    output_string (outstate,
+				   outstate->after_newline + else_defined);
 		    def_state = IN_ELSE;
 		}
 		else if (def_state == OUTSIDE) {
-		    putline (fp, outstate->after_newline + if_defined,
-			     R_do_defines, nullptr);
+		    output_directive (outstate,
+				      outstate->after_newline + if_defined);
 		    def_state = IN_IFDEF;
 		}
-		if (ferror (fp))
-		  write_fatal ();
 	    }
-	    outstate->after_newline = pch_write_line (new, fp);
+	    outstate->after_newline = output_pch_line (outstate, new);
 	    outstate->zero_output = false;
 	    new++;
 	}
@@ -1479,16 +2750,14 @@ apply_hunk (struct outstate *outstate, idx_t where)
 		return false;
 	    assert (outstate->after_newline);
 	    if (R_do_defines) {
-	       putline (fp, 1 + not_defined, R_do_defines, nullptr);
-	       if (ferror (fp))
-		write_fatal ();
+	       output_directive (outstate, 1 + not_defined);
 	       def_state = IN_IFNDEF;
 	    }
 
 	    do
 	      {
 		if (R_do_defines) {
-		    outstate->after_newline = pch_write_line (old, fp);
+		    outstate->after_newline = output_pch_line (outstate, old);
 		}
 		last_frozen_line++;
 		old++;
@@ -1496,15 +2765,13 @@ apply_hunk (struct outstate *outstate, idx_t where)
 	    while (pch_char (old) == '!');
 
 	    if (R_do_defines) {
-		Fputs (outstate->after_newline + else_defined, fp);
-		if (ferror (fp))
-		  write_fatal ();
+		output_string (outstate, outstate->after_newline + else_defined);
 		def_state = IN_ELSE;
 	    }
 
 	    do
 	      {
-		outstate->after_newline = pch_write_line (new, fp);
+		outstate->after_newline = output_pch_line (outstate, new);
 		new++;
 	      }
 	    while (pch_char (new) == '!');
@@ -1515,9 +2782,7 @@ apply_hunk (struct outstate *outstate, idx_t where)
 	    old++;
 	    new++;
 	    if (R_do_defines && def_state != OUTSIDE) {
-		Fputs (outstate->after_newline + end_defined, fp);
-		if (ferror (fp))
-		  write_fatal ();
+		output_string (outstate, outstate->after_newline + end_defined);
 		outstate->after_newline = true;
 		def_state = OUTSIDE;
 	    }
@@ -1528,36 +2793,34 @@ apply_hunk (struct outstate *outstate, idx_t where)
 	    return false;
 	if (R_do_defines) {
 	    if (def_state == OUTSIDE) {
-		putline (fp, outstate->after_newline + if_defined,
-			 R_do_defines, nullptr);
+		output_directive (outstate,
+				  outstate->after_newline + if_defined);
 		def_state = IN_IFDEF;
 	    }
 	    else if (def_state == IN_IFNDEF) {
-		Fputs (outstate->after_newline + else_defined, fp);
+		output_string (outstate,
+			       outstate->after_newline + else_defined);
 		def_state = IN_ELSE;
 	    }
-	    if (ferror (fp))
-	      write_fatal ();
 	    outstate->zero_output = false;
 	}
 
 	do
 	  {
 	    if (!outstate->after_newline)
-	      Fputc ('\n', fp);
-	    outstate->after_newline = pch_write_line (new, fp);
+	      output_text (outstate, "\n", 1);
+	    outstate->after_newline = output_pch_line (outstate, new);
 	    outstate->zero_output = false;
 	    new++;
 	  }
 	while (new <= pat_end && pch_char (new) == '+');
     }
     if (R_do_defines && def_state != OUTSIDE) {
-	Fputs (outstate->after_newline + end_defined, fp);
-	if (ferror (fp))
-	  write_fatal ();
+	output_string (outstate, outstate->after_newline + end_defined);
 	outstate->after_newline = true;
     }
-    out_offset += pch_repl_lines() - pch_ptrn_lines ();
+    out_offset += delta;
+    record_hunk (where + 1, delta);
     return true;
 }
 
@@ -1630,41 +2893,369 @@ bool
 copy_till (struct outstate *outstate, idx_t lastline)
 {
     idx_t R_last_frozen_line = last_frozen_line;
-    FILE *fp = outstate->ofp;
 
     if (R_last_frozen_line > lastline)
       {
 	say ("misordered hunks! output would be garbled\n");
 	return false;
       }
-    while (R_last_frozen_line < lastline)
+    if (R_last_frozen_line < lastline)
       {
-	R_last_frozen_line++;
-	struct iline line = ifetch (R_last_frozen_line);
-	if (line.size)
-	  {
-	    if (!outstate->after_newline)
-	      Fputc ('\n', fp);
-	    Fwrite (line.ptr, 1, line.size, fp);
-	    outstate->after_newline = line.ptr[line.size - 1] == '\n';
-	    outstate->zero_output = false;
-	  }
+	/* Copy the lines in one go.  Lines past end of file are empty.  */
+	struct iline first = ifetch (R_last_frozen_line + 1);
+	struct iline last = first.size ? ifetch (lastline) : first;
+	copy_input (outstate,
+		    (last.size
+		     ? (struct iline) { .ptr = first.ptr,
+					.size = last.ptr + last.size - first.ptr }
+		     : input_tail (R_last_frozen_line + 1)));
+	R_last_frozen_line = lastline;
       }
     last_frozen_line = R_last_frozen_line;
     return true;
 }
 
-/* Finish copying the input file to the output file. */
+/* Spans of input at least this long are copied to the output file
+   by the kernel if it can, rather than through user space.  */
+enum { COPY_RANGE_MIN = 64 * 1024 };
+
+/* The most buffers to give writev at once.  */
+#if defined IOV_MAX && IOV_MAX < 1024
+enum { OUT_IOV_MAX = IOV_MAX };
+#else
+enum { OUT_IOV_MAX = 1024 };
+#endif
+
+/* Add SIZE bytes at PTR to the output, as a span of the input if INPUT.
+   The bytes must stay put until the output is flushed.  */
+
+static void
+add_piece (char const *ptr, idx_t size, bool input)
+{
+  if (!size)
+    return;
+
+  if (out_sealed < out_pieces)
+    {
+      struct outpiece *last = &out_piece[out_pieces - 1];
+      if (last->input == input && last->ptr + last->size == ptr)
+	{
+	  last->size += size;
+	  return;
+	}
+    }
+
+  if (out_pieces == out_piece_alloc)
+    out_piece = xpalloc (out_piece, &out_piece_alloc, 1, -1,
+			 sizeof *out_piece);
+  out_piece[out_pieces++] = (struct outpiece) {
+    .ptr = ptr, .size = size, .line = last_frozen_line + 1, .input = input
+  };
+}
+
+/* Output SIZE bytes of TEXT, which need not stay put.  */
+
+void
+output_text (struct outstate *outstate, char const *text, idx_t size)
+{
+  if (!out_text_base)
+    {
+      obstack_init (&out_text);
+      obstack_alignment_mask (&out_text) = 0;
+      out_text_base = obstack_alloc (&out_text, 0);
+    }
+  add_piece (obstack_copy (&out_text, text, size), size, false);
+}
+
+/* Output the string S.  */
+
+void
+output_string (struct outstate *outstate, char const *s)
+{
+  output_text (outstate, s, strlen (s));
+}
+
+/* Output a line of patch.  Return true if it ended in a newline.  */
+
+bool
+output_pch_line (struct outstate *outstate, idx_t line)
+{
+  idx_t len = pch_line_len (line);
+  char const *s = pfetch (line);
+  output_text (outstate, s, len);
+  return len && s[len - 1] == '\n';
+}
+
+/* Output DIRECTIVE followed by the symbol given with -D and a newline.  */
+
+static void
+output_directive (struct outstate *outstate, char const *directive)
+{
+  output_string (outstate, directive);
+  output_string (outstate, do_defines);
+  output_text (outstate, "\n", 1);
+}
+
+/* Copy a span of whole input lines to the output file.  */
+
+static void
+copy_input (struct outstate *outstate, struct iline span)
+{
+    if (span.size)
+      {
+	if (!outstate->after_newline)
+	  output_text (outstate, "\n", 1);
+	add_piece (span.ptr, span.size, true);
+	outstate->after_newline = span.ptr[span.size - 1] == '\n';
+	outstate->zero_output = false;
+      }
+}
+
+/* Write the N buffers described by IOV to the file descriptor FD.  */
+
+static void
+write_iov (int fd, struct iovec *iov, int n)
+{
+  while (n)
+    {
+#if HAVE_WRITEV
+      ssize_t w = writev (fd, iov, n);
+#else
+      ssize_t w = write (fd, iov->iov_base, iov->iov_len);
+#endif
+      if (w < 0)
+	write_fatal ();
+      for (; n && iov->iov_len <= w; iov++, n--)
+	w -= iov->iov_len;
+      if (n)
+	{
+	  iov->iov_base = (char *) iov->iov_base + w;
+	  iov->iov_len -= w;
+	}
+    }
+}
+
+/* Write out the output built so far, or discard it if there is no
+   output file, as in a dry run.  */
+
+static void
+flush_output (struct outstate *outstate)
+{
+  if (out_pieces && outstate->ofp)
+    {
+      FILE *fp = outstate->ofp;
+      int fd = fileno (fp);
+      struct iovec iov[OUT_IOV_MAX];
+      int n = 0;
+
+      /* Anything written directly to the stream comes first.  */
+      Fflush (fp);
+
+      for (idx_t i = 0; i < out_pieces; i++)
+	{
+	  char const *ptr = out_piece[i].ptr;
+	  idx_t size = out_piece[i].size;
+
+	  if (out_piece[i].input && COPY_RANGE_MIN <= size)
+	    {
+	      write_iov (fd, iov, n);
+	      n = 0;
+	      idx_t copied = copy_input_range (fd, ptr, size);
+	      ptr += copied;
+	      size -= copied;
+	    }
+
+	  /* Keep the total size of a batch within what writev allows.  */
+	  while (size)
+	    {
+	      idx_t len = MIN (size, SSIZE_MAX / OUT_IOV_MAX);
+	      if (n == OUT_IOV_MAX)
+		{
+		  write_iov (fd, iov, n);
+		  n = 0;
+		}
+	      iov[n++] = (struct iovec) { .iov_base = (char *) ptr,
+					  .iov_len = len };
+	      ptr += len;
+	      size -= len;
+	    }
+	}
+      write_iov (fd, iov, n);
+    }
+  out_pieces = out_sealed = 0;
+
+  if (out_text_base)
+    obstack_free (&out_text, out_text_base);
+}
+
+/* Remember that a hunk went at input line WHERE and added DELTA lines.  */
+
+static void
+record_hunk (idx_t where, ptrdiff_t delta)
+{
+  if (nplaced == nplaced_alloc)
+    placed = xpalloc (placed, &nplaced_alloc, 1, -1, sizeof *placed);
+  idx_t i = nplaced++;
+  for (; 0 < i && where < placed[i - 1].line; i--)
+    placed[i] = placed[i - 1];
+  placed[i].line = where;
+  placed[i].delta = delta;
+}
+
+/* Return how many lines the hunks applied so far before input line
+   WHERE have added.  */
+
+static ptrdiff_t
+output_offset (idx_t where)
+{
+  ptrdiff_t offset = 0;
+  for (idx_t i = 0; i < nplaced && placed[i].line < where; i++)
+    offset += placed[i].delta;
+  return offset;
+}
+
+/* Return the index of the piece of output that is an unchanged span of
+   input containing the input lines FIRST through LAST, or -1 if there
+   is none.  If LAST < FIRST, the span need only contain the start of
+   line FIRST.  */
+
+static idx_t
+unchanged_input_piece (idx_t first, idx_t last)
+{
+  /* Find the last piece that starts at or before FIRST.  */
+  idx_t lo = 0, hi = out_pieces;
+  while (lo < hi)
+    {
+      idx_t mid = lo + (hi - lo) / 2;
+      if (out_piece[mid].line <= first)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  if (!lo || first < 1)
+    return -1;
+
+  struct outpiece const *p = &out_piece[lo - 1];
+  char const *start = ifetch (first).ptr;
+  struct iline l = ifetch (MAX (first, last));
+  char const *end = last < first ? start + 1 : l.ptr + l.size;
+  return (p->input && p->ptr <= start && l.size
+	  && end <= p->ptr + p->size
+	  ? lo - 1 : -1);
+}
+
+/* Apply the current hunk at WHERE, which is within the part of the
+   input file already output, by splicing it in among the pieces of
+   output.  The lines it replaces must not have been changed.  */
 
 static bool
+splice_hunk (struct outstate *outstate, idx_t where)
+{
+    idx_t i = unchanged_input_piece (where, where + pch_ptrn_lines () - 1);
+    if (i < 0)
+      {
+	say ("misordered hunk overlaps another hunk\n");
+	return false;
+      }
+
+    /* Cut the piece at WHERE, and output the hunk at the end of the list
+       as if the rest of the file came after it.  */
+    idx_t frozen = last_frozen_line;
+    bool after_newline = outstate->after_newline;
+    idx_t pieces = out_pieces;
+    char const *start = ifetch (where).ptr;
+    char const *end = out_piece[i].ptr + out_piece[i].size;
+    out_piece[i].size = start - out_piece[i].ptr;
+    last_frozen_line = where - 1;
+    outstate->after_newline = true;
+    out_sealed = pieces;
+    MAYBE_UNUSED bool applied = apply_hunk (outstate, where);
+    assert (applied);
+
+    /* Then the rest of the piece.  */
+    struct iline l = ifetch (last_frozen_line);
+    char const *rest = last_frozen_line < where ? start : l.ptr + l.size;
+    if (rest < end || i + 1 < pieces)
+      {
+	if (!outstate->after_newline)
+	  output_text (outstate, "\n", 1);
+	add_piece (rest, end - rest, true);
+	outstate->after_newline = after_newline;
+      }
+
+    /* Move the new pieces to just after the piece that was cut.  */
+    idx_t n = out_pieces - pieces;
+    struct outpiece *spliced = ximemdup (&out_piece[pieces],
+					 n * sizeof *out_piece);
+    memmove (&out_piece[i + 1 + n], &out_piece[i + 1],
+	     (pieces - (i + 1)) * sizeof *out_piece);
+    memcpy (&out_piece[i + 1], spliced, n * sizeof *out_piece);
+    free (spliced);
+
+    last_frozen_line = frozen;
+    out_sealed = 0;
+    return true;
+}
+
+/* Find where the current hunk goes before the part of the input file
+   already output, as when the hunks of a patch are out of order.  Only
+   an exact match in lines no hunk has changed will do.  Search outward
+   from where the hunk is expected, as locate_hunk does.  Return the
+   line number, or 0 if there is no such place.  */
+
+static idx_t
+locate_misordered_hunk (void)
+{
+    idx_t pat_lines = pch_ptrn_lines ();
+    idx_t prefix_context = pch_prefix_context ();
+    idx_t suffix_context = pch_suffix_context ();
+    idx_t first_guess = pch_first () + in_offset;
+    idx_t lo = 1;
+    idx_t hi = last_frozen_line - pat_lines + 1;
+
+    /* As in locate_hunk, a hunk with less context at its end can match
+       only at end of file, and one with less context at its start
+       that begins the file can match only at its start.  */
+    if (suffix_context < prefix_context)
+      return 0;
+    if (prefix_context < suffix_context && pch_first () <= 1)
+      hi = MIN (hi, 1);
+
+    for (idx_t d = MAX (0, first_guess - hi); ; d++)
+      {
+	idx_t up = first_guess + d, down = first_guess - d;
+	if (hi < up && down < lo)
+	  return 0;
+	for (int sign = 1; -1 <= sign; sign -= 2)
+	  {
+	    idx_t where = 0 < sign ? up : down;
+	    if (lo <= where && where <= hi
+		&& patch_match (where, 0, 0, 0)
+		&& 0 <= unchanged_input_piece (where, where + pat_lines - 1))
+	      {
+		if (debug & 1)
+		  say ("Offset changing from %td to %td\n",
+		       in_offset, where - pch_first ());
+		in_offset = where - pch_first ();
+		return where;
+	      }
+	    if (!d)
+	      break;
+	  }
+      }
+}
+
+/* Finish copying the input file to the output file. */
+
+static void
 spew_output (struct outstate *outstate, struct stat *st)
 {
     if (debug & 256)
-      say ("il=%td lfl=%td\n", input_lines, last_frozen_line);
+      say ("il=%td lfl=%td\n", input_lines (), last_frozen_line);
 
-    if (last_frozen_line < input_lines)
-      if (! copy_till (outstate, input_lines))
-	return false;
+    /* Copy the rest of the input file without indexing its lines.  */
+    copy_input (outstate, input_tail (last_frozen_line + 1));
+    flush_output (outstate);
 
     if (outstate->ofp && ! outfile)
       {
@@ -1672,8 +3263,40 @@ spew_output (struct outstate *outstate, struct stat *st)
 	if (fstat (fileno (outstate->ofp), st) < 0)
 	  write_fatal ();
       }
+}
 
-    return true;
+/* Can apply_ed_script apply the ed script to the input file?  Not if
+   the script addresses lines past its end, as ed then fails; nor if its
+   last line lacks a newline, which ed might supply.  */
+
+static bool
+ed_script_fits (void)
+{
+  struct iline all = input_tail (1);
+  if (all.size && all.ptr[all.size - 1] != '\n')
+    return false;
+  return input_has_lines (ed_last_address ());
+}
+
+/* Apply the changes of the ed script read by read_ed_script.  They are
+   in descending order, so apply them from the last.  */
+
+static void
+apply_ed_script (struct outstate *outstate)
+{
+  for (idx_t i = ed_changes_count (); 0 < i--; )
+    {
+      struct ed_change c = ed_change (i);
+      copy_till (outstate, c.first - 1);
+      for (idx_t j = 0; j < c.ntext; j++)
+	{
+	  idx_t len;
+	  char const *text = ed_text_line (c.text + j, &len);
+	  output_text (outstate, text, len);
+	  outstate->zero_output = false;
+	}
+      last_frozen_line = c.last;
+    }
 }
 
 /* Does the patch pattern match at line base+offset? */
@@ -1681,10 +3304,21 @@ spew_output (struct outstate *outstate, struct stat *st)
 static bool
 patch_match (idx_t base, ptrdiff_t offset, idx_t prefix_fuzz, idx_t suffix_fuzz)
 {
-    idx_t pat_lines = pch_ptrn_lines () - suffix_fuzz;
+    return match_lines (base, offset, 1 + prefix_fuzz,
+			pch_ptrn_lines () - suffix_fuzz);
+}
 
-    for (idx_t pline = 1 + prefix_fuzz; pline <= pat_lines; pline++) {
-	struct iline line = ifetch (pline - 1 + base + offset);
+/* Do pattern lines FIRST through LAST match at line base+offset?  */
+
+static bool
+match_lines (idx_t base, ptrdiff_t offset, idx_t first, idx_t last)
+{
+    for (idx_t pline = first; pline <= last; pline++) {
+	idx_t iline = pline - 1 + base + offset;
+	if (canonicalize_ws
+	    && input_line_hash (iline) != pch_line_hash (pline))
+	    return false;
+	struct iline line = ifetch (iline);
 	if (canonicalize_ws) {
 	    if (!similar(line.ptr, line.size,
 			 pfetch(pline),
@@ -1709,11 +3343,12 @@ check_line_endings (idx_t where)
     return false;
   bool patch_crlf = 2 <= size && p[size - 2] == '\r' && p[size - 1] == '\n';
 
-  if (! input_lines)
-    return false;
-  if (where > input_lines)
-    where = input_lines;
   struct iline line = ifetch (where);
+  if (! line.size && 0 < where)
+    {
+      /* WHERE is past end of file; look at the last line instead.  */
+      line = ifetch (input_lines ());
+    }
   if (! line.size)
     return false;
   bool input_crlf = (2 <= line.size
@@ -1760,6 +3395,7 @@ struct file_to_delete {
   char *name;
   struct stat st;
   bool backup;
+  bool renamed;		/* whether the file was renamed away instead */
   struct file_to_delete *next;
 };
 
@@ -1782,19 +3418,37 @@ delete_file_later (char *name, const struct stat *st, bool backup)
   file_to_delete->name = xstrdup (name);
   file_to_delete->st = *st;
   file_to_delete->backup = backup;
+  file_to_delete->renamed = false;
   file_to_delete->next = nullptr;
   *files_to_delete_tail = file_to_delete;
   files_to_delete_tail = &file_to_delete->next;
   insert_file_id (st, DELETE_LATER);
 }
 
+/* In a job, remove the directories that the renaming of NAME left
+   empty along with the files to delete, once all jobs have output
+   their files.  */
+
+static void
+remove_dirs_later (char const *name)
+{
+  struct file_to_delete *file_to_delete = xmalloc (sizeof *file_to_delete);
+  file_to_delete->name = xstrdup (name);
+  file_to_delete->renamed = true;
+  file_to_delete->next = nullptr;
+  *files_to_delete_tail = file_to_delete;
+  files_to_delete_tail = &file_to_delete->next;
+}
+
 static void
 delete_files (void)
 {
   struct file_to_delete *next;
   for (struct file_to_delete *f = files_to_delete; f; f = next)
     {
-      if (lookup_file_id (&f->st) == DELETE_LATER)
+      if (f->renamed)
+	removedirs (f->name);
+      else if (lookup_file_id (&f->st) == DELETE_LATER)
 	{
 	  mode_t mode = f->st.st_mode;
 
@@ -1815,17 +3469,34 @@ struct file_to_output {
   struct outfile from;
   struct stat from_st;
   char *volatile to;
+  /* In files_to_sync, the file that TO names until then.  */
+  dev_t to_dev;
+  ino_t to_ino;
   mode_t mode;
   bool backup;
   struct file_to_output *volatile next;
 };
 
-static struct file_to_output *volatile files_to_output;
-static struct file_to_output *volatile *files_to_output_tail =
-  &files_to_output;
+/* A queue of files to put into place later.  */
+struct output_queue
+{
+  struct file_to_output *volatile head;
+  struct file_to_output *volatile *tail;
+};
 
-static void
-output_file_later (struct outfile *from, const struct stat *from_st,
+/* The output of git diffs; see output_file.  */
+static struct output_queue files_to_output =
+  { .tail = &files_to_output.head };
+
+/* With --fsync, the output of other diffs that replaces existing
+   files, waiting to be synced along with other output; see
+   output_file_after_sync.  */
+enum { SYNC_BATCH = 64 };
+static struct output_queue files_to_sync = { .tail = &files_to_sync.head };
+
+static struct file_to_output *
+output_file_later (struct output_queue *q,
+		   struct outfile *from, const struct stat *from_st,
 		   char const *to, mode_t mode, bool backup)
 {
   idx_t tosize = to ? strlen (to) + 1 : 0;
@@ -1844,11 +3515,12 @@ output_file_later (struct outfile *from, const struct stat *from_st,
 
   /* In a critical section, transfer ownership from FROM to F->from.  */
   defer_signals ();
-  *files_to_output_tail = f;
+  *q->tail = f;
   from->exists = nullptr;
   undefer_signals ();
 
-  files_to_output_tail = &f->next;
+  q->tail = &f->next;
+  return f;
 }
 
 static void
@@ -1864,10 +3536,40 @@ output_file_now (struct outfile *from,
   else
     {
       assert (0 <= from_st->st_size);
-      move_file (from, from_st, to, mode, backup);
+      if (from->temporary)
+	move_file (from, from_st, to, mode, backup);
+      else if (! strEQ (from->name, to))
+	{
+	  move_file (from, from_st, to, mode, backup);
+	  if (in_job ())
+	    remove_dirs_later (from->name);
+	  else
+	    removedirs (from->name);
+	}
+      else
+	{
+	  if (backup)
+	    create_backup (to, from_st, true);
+	  insert_file_id (from_st, CREATED);
+	  from->exists = nullptr;
+	}
+
+      /* A file renamed or kept in place still has its old mode.  */
+      if (! from->temporary && (from_st->st_mode ^ mode) & S_IRWXUGO)
+	set_file_attributes (to, -1, FA_MODE, nullptr, -1, nullptr,
+			     mode, nullptr);
     }
 }
 
+/* Should the output of the current patch be queued until the end of
+   its git diff, rather than put in place at once?  */
+
+static bool
+output_later (void)
+{
+  return pch_git_diff () && pch_says_nonexistent (reverse_flag) != 2;
+}
+
 static void
 output_file (struct outfile *from,
 	     const struct stat *from_st, char *to,
@@ -1881,7 +3583,7 @@ output_file (struct outfile *from,
 
       delete_file_later (to, to_st, backup);
     }
-  else if (pch_git_diff () && pch_says_nonexistent (reverse_flag) != 2)
+  else if (output_later ())
     {
       /* In git-style diffs, the "before" state of each patch refers to the initial
 	 state before modifying any files, input files can be referenced more than
@@ -1897,20 +3599,107 @@ output_file (struct outfile *from,
 	 concatenated git-style diffs.
       */
 
-      output_file_later (from, from_st, to, mode, backup);
+      output_file_later (&files_to_output, from, from_st, to, mode, backup);
     }
   else
-    output_file_now (from, from_st, to, mode, backup);
+    {
+      /* TO may be a file still to be renamed; see main.  */
+      struct stat st;
+      if (files_to_output.head && stat_file (to, &st) == 0
+	  && has_queued_output (&st))
+	output_files (&st, 0);
+
+      output_file_now (from, from_st, to, mode, backup);
+    }
+}
+
+/* With --fsync, the output of a diff other than a git diff waits in
+   files_to_sync until its data can be synced along with that of other
+   output, if it replaces an existing file.  Queue FROM, whose status
+   is FROM_ST, to replace TO, whose status is TO_ST.  At most SYNC_BATCH
+   files wait at once, so that an interrupt throws away little work.  */
+
+static void
+output_file_after_sync (struct outfile *from, struct stat const *from_st,
+			char *to, struct stat const *to_st,
+			mode_t mode, bool backup)
+{
+  struct file_to_output *f = output_file_later (&files_to_sync, from,
+						from_st, to, mode, backup);
+  f->to_dev = to_st->st_dev;
+  f->to_ino = to_st->st_ino;
+  if (++nfiles_to_sync == SYNC_BATCH)
+    output_files (nullptr, 0);
+}
+
+/* Is the file with status ST to be replaced by output in files_to_sync?  */
+
+static bool
+waits_for_sync (struct stat const *st)
+{
+  for (struct file_to_output *f = files_to_sync.head; f; f = f->next)
+    if (f->to_dev == st->st_dev && f->to_ino == st->st_ino)
+      return true;
+  return false;
+}
+
+/* With --fsync, for each file system with output not yet synced, a
+   descriptor of one of the files on it, to pass to syncfs.  */
+#if HAVE_SYNCFS
+static struct sync_fd { dev_t dev; int fd; } *sync_fds;
+static idx_t nsync_fds, sync_fds_alloc;
+#endif
+
+/* With --fsync, arrange for the data written to FD, a file on the file
+   system with device number DEV, to be synced later along with the
+   other output on that file system, and return true.  If the system
+   cannot sync a whole file system, sync FD now and return false.  */
+
+static bool
+defer_sync (int fd, dev_t dev)
+{
+#if HAVE_SYNCFS
+  for (idx_t i = 0; i < nsync_fds; i++)
+    if (sync_fds[i].dev == dev)
+      return true;
+  int dupfd = dup (fd);
+  if (0 <= dupfd)
+    {
+      if (nsync_fds == sync_fds_alloc)
+	sync_fds = xpalloc (sync_fds, &sync_fds_alloc, 1, -1,
+			    sizeof *sync_fds);
+      sync_fds[nsync_fds++] = (struct sync_fd) { .dev = dev, .fd = dupfd };
+      return true;
+    }
+#endif
+  sync_file (fd);
+  return false;
+}
+
+/* Sync the file systems that defer_sync has noted.  A single syncfs
+   costs about as much as syncing one file.  */
+
+static void
+sync_deferred (void)
+{
+#if HAVE_SYNCFS
+  while (0 < nsync_fds)
+    {
+      int fd = sync_fds[--nsync_fds].fd;
+      if (syncfs (fd) < 0 || close (fd) < 0)
+	write_fatal ();
+    }
+#endif
 }
 
-/* A root to pacify -fsanitize=address if it is being used.  */
+/* Roots to pacify -fsanitize=address if it is being used.  */
 #if SANITIZE_ADDRESS
-extern struct file_to_output *volatile files_to_output_root;
-struct file_to_output *volatile files_to_output_root
+extern struct file_to_output *volatile files_to_output_root[2];
+struct file_to_output *volatile files_to_output_root[2]
   ATTRIBUTE_EXTERNALLY_VISIBLE;
 #endif
 
-/* Output files that were delayed until now.
+/* Output the files in Q that were delayed until now.
    If ST, output only files up to and including ST.
 
    EXITING == 0 is the typical case.
@@ -1920,13 +3709,16 @@ struct file_to_output *volatile files_to_output_root
    and of course do not attempt to free memory.  */
 
 static void
-output_files (struct stat const *st, int exiting)
+output_queued_files (struct output_queue *q, struct stat const *st,
+		     int exiting)
 {
   struct file_to_output *next;
-  struct file_to_output *f = files_to_output;
+  struct file_to_output *f = q->head;
 #if SANITIZE_ADDRESS
-  files_to_output_root = f;
+  files_to_output_root[q == &files_to_sync] = f;
 #endif
+  if (f && fsync_output && 0 <= exiting)
+    sync_deferred ();
   for (; f; f = next)
     {
       char *to = f->to;
@@ -1938,7 +3730,7 @@ output_files (struct stat const *st, int exiting)
 	  /* Do not call 'safe_unlink' as it is not async-signal-safe.
 	     'unlink' should be good enough here, as we already
 	     checked the file's parent directory.  */
-	  if (to)
+	  if (to && f->from.temporary)
 	    {
 	      char volatile *exists = f->from.exists;
 	      if (exists)
@@ -1959,7 +3751,7 @@ output_files (struct stat const *st, int exiting)
 	      if (exists)
 		safe_unlink (devolatilize (exists));
 	    }
-	  files_to_output = next;
+	  q->head = next;
 	  undefer_signals ();
 
 	  early_return = (st
@@ -1974,13 +3766,28 @@ output_files (struct stat const *st, int exiting)
 	}
 
       if (!next)
-	files_to_output_tail = &files_to_output;
+	q->tail = &q->head;
 
       if (early_return)
 	return;
     }
 }
 
+/* Output files that were delayed until now: if ST, the output of git
+   diffs up to and including ST, and otherwise all output.  EXITING is
+   as for output_queued_files.  */
+
+static void
+output_files (struct stat const *st, int exiting)
+{
+  if (! st)
+    {
+      output_queued_files (&files_to_sync, nullptr, exiting);
+      nfiles_to_sync = 0;
+    }
+  output_queued_files (&files_to_output, st, exiting);
+}
+
 /* Clean up temp files after a signal.  This function is async-signal-safe.  */
 
 void
@@ -20,6 +20,7 @@
 #include <basename-lgpl.h>
 #include <filename.h>
 #include <inp.h>
+#include <obstack.h>
 #include <quotearg.h>
 #include <util.h>
 #include <xalloc.h>
@@ -29,11 +30,35 @@
 #endif
 #include <safe.h>
 
+#if HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
 #define INITHUNKMAX 125			/* initial dynamic allocation size */
 
+#define obstack_chunk_alloc xmalloc
+#define obstack_chunk_free free
+
 /* Patch (diff listing) abstract type. */
 
-static FILE *pfp;			/* patch file pointer */
+static char *p_buf;			/* contents of the patch file */
+static off_t p_bufpos;			/* patch file position of p_buf[0] */
+static idx_t p_buflen;			/* number of bytes in p_buf */
+static off_t p_pos;			/* current position in patch file */
+static char const *p_src;		/* where patchbuf's line is in p_buf */
+
+/* When the patch comes from a pipe, it is read as a stream, and p_buf
+   is a window into it that keeps only what may be needed again.  Data
+   before p_keep may be discarded.  If the window grows too large, its
+   older part is spooled to tmppat, and it covers patch file positions
+   starting at p_spoolpos.  */
+enum { PATCH_WINDOW = 16 * IO_BUFSIZE };
+static int p_stream_fd = -1;		/* patch being streamed, or -1 */
+static bool p_stream_eof;		/* true if all of it has been read */
+static idx_t p_bufsize;			/* allocated size of p_buf */
+static off_t p_keep;			/* earliest position still needed */
+static off_t p_spoolpos;		/* position of tmppat's first byte */
+static int p_spoolfd = -1;		/* tmppat, or -1 if not yet created */
 static char p_says_nonexistent[2];	/* [0] for old file, [1] for new:
 		0 for existent and nonempty,
 		1 for existent and probably (but not necessarily) empty,
@@ -47,7 +72,6 @@ struct timespec p_timestamp[2];		/* timestamps in patch headers */
 static char *p_timestr[2];		/* timestamps as strings */
 static char *p_sha1[2];			/* SHA1 checksums */
 static mode_t p_mode[2];		/* file modes */
-static off_t p_filesize;		/* size of the patch file */
 static idx_t p_first;			/* 1st line number */
 static idx_t p_newfirst;		/* 1st line number of replacement */
 static idx_t p_ptrn_lines;		/* # lines in pattern */
@@ -60,7 +84,11 @@ static idx_t p_input_line;		/* current line # from patch file */
 static char **p_line;			/* the text of the hunk */
 static idx_t *p_len;			/* line length including \n if any */
 static char *p_Char;			/* +, -, and ! */
+static uint_least32_t *p_hash;		/* hash_line of each line */
+static bool p_hashed;			/* whether p_hash is up to date */
 static idx_t hunkmax = INITHUNKMAX;	/* size of above arrays */
+static struct obstack p_hunk_stack;	/* hunk text that is not in p_buf */
+static char *p_hunk_base;		/* bottom of p_hunk_stack */
 static idx_t p_indent;			/* indent to patch */
 static bool p_strip_trailing_cr;	/* true if stripping trailing \r */
 static bool p_pass_comments_through;	/* true if not ignoring # lines */
@@ -69,22 +97,45 @@ static idx_t p_bline;			/* line # of p_base */
 static off_t p_start;			/* where intuit found a patch */
 static idx_t p_sline;			/* and the line number for it */
 static idx_t p_hunk_beg;		/* line number of current hunk */
-static ptrdiff_t p_efake = -1;		/* end of faked up lines--don't free */
-static ptrdiff_t p_bfake = -1;		/* beg of faked up lines */
 static char *p_c_function;		/* the C function a hunk is in */
 static bool p_git_diff;			/* true if this is a git style diff */
+static bool p_no_hunks;			/* true if the patch has no hunks */
+static char *ed_script;			/* text of the ed script */
+static idx_t ed_script_used;		/* # of bytes in ed_script */
+static idx_t ed_script_size;		/* allocated size of ed_script */
+static struct ed_change *ed_changes;	/* changes made by the ed script */
+static idx_t ed_nchanges;		/* # of elements in ed_changes */
+static idx_t ed_changes_alloc;		/* allocated size of ed_changes */
+static idx_t ed_max_address;		/* highest line address they use */
+static struct ed_line
+{
+  idx_t offset;				/* offset of text in ed_script */
+  idx_t len;				/* length including newline */
+} *ed_line;				/* text lines of the ed script */
+static idx_t ed_nlines;			/* # of elements in ed_line */
+static idx_t ed_lines_alloc;		/* allocated size of ed_line */
 
 static enum diff intuit_diff_type (bool, mode_t *);
 static enum nametype best_name (char * const *, int const *);
 static idx_t prefix_components (char *, bool);
+static void read_patch_file (int, off_t);
+static bool read_hunk (enum diff, bool);
+static char const *patch_line_at (off_t, char const **);
+static void fill_patch_window (off_t);
+static void unspool_patch (off_t);
+static bool patch_eof (off_t);
 static idx_t pget_line (idx_t, idx_t, bool, bool, bool);
 static idx_t get_line (bool);
+static char *hunk_line (char const *, idx_t);
+static char *hunk_copy (char const *, idx_t);
 static bool incomplete_line (void);
-static void grow_hunkmax (void);
+static void grow_hunkmax (idx_t);
 static void malformed (void);
 static void next_intuit_at (off_t, idx_t);
 static void skip_to (off_t, idx_t);
 static char get_ed_command_letter (char const *);
+static idx_t ed_line_number (char const **);
+static void save_ed_script (char const *, idx_t);
 
 static char initial_patchbuf[IO_BUFSIZE];
 char *patchbuf = initial_patchbuf;
@@ -122,16 +173,16 @@ open_patch_file (char const *filename)
     off_t file_pos = 0;
     off_t pos;
     struct stat st;
+    int pfd;
 
     if (!filename || !*filename || strEQ (filename, "-"))
-      pfp = stdin;
+      pfd = STDIN_FILENO;
     else
       {
-	pfp = fopen (filename, binary_transput ? "rb" : "r");
-	if (!pfp)
+	pfd = open (filename, O_RDONLY | binary_transput);
+	if (pfd < 0)
 	  pfatal ("Can't open patch file %s", quotearg (filename));
       }
-    int pfd = fileno (pfp);
 #if HAVE_SETMODE_DOS
     if (binary_transput)
       {
@@ -142,51 +193,243 @@ open_patch_file (char const *filename)
 #endif
     if (fstat (pfd, &st) < 0)
       pfatal ("fstat");
-    if (S_ISREG (st.st_mode) && 0 <= (pos = ftello (pfp)))
+    if (S_ISREG (st.st_mode) && 0 <= (pos = lseek (pfd, 0, SEEK_CUR)))
       file_pos = pos;
+    else if ((S_ISFIFO (st.st_mode) || S_ISSOCK (st.st_mode)) && jobs <= 1)
+      {
+	/* Start work on the patch while the rest of it is still arriving.
+	   With several jobs, all of it is needed first, to divide it.  */
+	p_stream_fd = pfd;
+	p_bufsize = IO_BUFSIZE;
+	p_buf = ximalloc (p_bufsize);
+	next_intuit_at (0, 1);
+	return;
+      }
     else
       {
 	idx_t charsread;
-	int fd;
-	FILE *read_pfp = pfp;
-	fd = make_tempfile (&tmppat, 'p', nullptr, O_RDWR | O_BINARY, 0);
+	int fd = make_tempfile (&tmppat, 'p', nullptr, O_RDWR | O_BINARY, 0);
 	if (fd < 0)
 	  pfatal ("Can't create temporary file %s", tmppat.name);
-	pfp = fdopen (fd, "w+b");
-	if (! pfp)
-	  pfatal ("Can't open stream for file %s", quotearg (tmppat.name));
 	for (st.st_size = 0;
 	     (charsread = Read (pfd, patchbuf, patchbufsize)) != 0;
 	     st.st_size += charsread)
-	  Fwrite (patchbuf, 1, charsread, pfp);
-	if (fclose (read_pfp) < 0)
+	  Write (fd, patchbuf, charsread);
+	if (pfd != STDIN_FILENO && close (pfd) < 0)
 	  read_fatal ();
-	Fflush (pfp);
-	Fseeko (pfp, 0, SEEK_SET);
+	pfd = fd;
       }
-    p_filesize = st.st_size;
+    read_patch_file (pfd, st.st_size);
+    if (pfd != STDIN_FILENO && close (pfd) < 0)
+      read_fatal ();
     next_intuit_at (file_pos, 1);
 }
 
+/* Read the SIZE bytes of the patch file FD into p_buf, by mapping the
+   file if possible.  */
+
+static void
+read_patch_file (int fd, off_t size)
+{
+  idx_t bufsize;
+  if (ckd_add (&bufsize, size, 0))
+    xalloc_die ();
+
+#if HAVE_MMAP
+  if (bufsize)
+    {
+      void *p = mmap (nullptr, bufsize, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED)
+	{
+	  p_buf = p;
+	  p_buflen = bufsize;
+	  return;
+	}
+    }
+#endif
+
+  p_buf = ximalloc (bufsize);
+  idx_t buffered = 0;
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    pfatal ("Can't rewind to the beginning of the patch");
+  while (buffered < bufsize)
+    {
+      ssize_t n = Read (fd, p_buf + buffered, bufsize - buffered);
+      if (n == 0)
+	break;
+      buffered += n;
+    }
+  p_buflen = buffered;
+}
+
+/* Return a pointer to the patch data at position POS, which is followed
+   by at least a full line unless the patch ends first.  Set *LIM to the
+   end of the data available.  */
+
+static char const *
+patch_line_at (off_t pos, char const **lim)
+{
+  if (0 <= p_stream_fd)
+    fill_patch_window (pos);
+  *lim = p_buf + p_buflen;
+  return p_buf + (pos - p_bufpos);
+}
+
+/* Read from the patch stream until the window holds a full line at POS,
+   or the stream ends.  Make room by discarding data that is no longer
+   needed, and by spooling data that is needed only for looking back.  */
+
+static void
+fill_patch_window (off_t pos)
+{
+  if (pos < p_bufpos)
+    unspool_patch (pos);
+
+  idx_t scanned = pos - p_bufpos;
+  while (! p_stream_eof
+	 && ! memchr (p_buf + scanned, '\n', p_buflen - scanned))
+    {
+      scanned = p_buflen;
+
+      if (p_bufsize - p_buflen < IO_BUFSIZE)
+	{
+	  idx_t drop = MIN (p_keep, pos) - p_bufpos;
+	  if (0 < drop)
+	    {
+	      /* Everything before the drop point is gone; restart the
+		 spool there.  */
+	      p_bufpos += drop;
+	      p_spoolpos = p_bufpos;
+	    }
+	  else
+	    {
+	      drop = pos - p_bufpos;
+	      if (drop <= PATCH_WINDOW)
+		drop = 0;
+	      else
+		{
+		  if (p_spoolfd < 0)
+		    {
+		      p_spoolfd = make_tempfile (&tmppat, 'p', nullptr,
+						 O_RDWR | O_BINARY, 0);
+		      if (p_spoolfd < 0)
+			pfatal ("Can't create temporary file %s",
+				tmppat.name);
+		    }
+		  if (lseek (p_spoolfd, p_bufpos - p_spoolpos, SEEK_SET) < 0)
+		    pfatal ("Can't seek in temporary file %s", tmppat.name);
+		  Write (p_spoolfd, p_buf, drop);
+		  p_bufpos += drop;
+		}
+	    }
+	  p_buflen -= drop;
+	  scanned -= drop;
+	  memmove (p_buf, p_buf + drop, p_buflen);
+
+	  if (p_bufsize - p_buflen < IO_BUFSIZE)
+	    p_buf = xpalloc (p_buf, &p_bufsize,
+			     IO_BUFSIZE - (p_bufsize - p_buflen), -1, 1);
+	}
+
+      idx_t n = Read (p_stream_fd, p_buf + p_buflen, p_bufsize - p_buflen);
+      p_stream_eof = n == 0;
+      p_buflen += n;
+    }
+}
+
+/* Bring the spooled patch data starting at POS back into the window.  */
+
+static void
+unspool_patch (off_t pos)
+{
+  assert (p_spoolpos <= pos);
+  idx_t n = p_bufpos - pos;
+  if (p_bufsize - p_buflen < n)
+    p_buf = xpalloc (p_buf, &p_bufsize, n - (p_bufsize - p_buflen), -1, 1);
+  memmove (p_buf + n, p_buf, p_buflen);
+  if (lseek (p_spoolfd, pos - p_spoolpos, SEEK_SET) < 0)
+    pfatal ("Can't seek in temporary file %s", tmppat.name);
+  for (idx_t buffered = 0; buffered < n; )
+    {
+      idx_t r = Read (p_spoolfd, p_buf + buffered, n - buffered);
+      if (r == 0)
+	read_fatal ();
+      buffered += r;
+    }
+  p_buflen += n;
+  p_bufpos = pos;
+}
+
+/* Return true if the patch has no data at position POS.  */
+
+static bool
+patch_eof (off_t pos)
+{
+  char const *lim;
+  return patch_line_at (pos, &lim) == lim;
+}
+
+/* The arrays describing a hunk share one allocation, with room for
+   HUNKMAX entries each.  */
+enum { HUNK_ENTRY_SIZE = (sizeof *p_line + sizeof *p_len + sizeof *p_hash
+			  + sizeof *p_Char) };
+
+/* Point p_line, p_len, p_hash and p_Char into BLOCK.  */
+
+static void
+set_hunk_arrays (void *block)
+{
+  p_line = block;
+  p_len = (idx_t *) (p_line + hunkmax);
+  p_hash = (uint_least32_t *) (p_len + hunkmax);
+  p_Char = (char *) (p_hash + hunkmax);
+}
+
 /* Make sure our dynamically realloced tables are malloced to begin with. */
 
 static void
 set_hunkmax (void)
 {
-  p_line = xireallocarray (p_line, hunkmax, sizeof *p_line);
-  p_len = xireallocarray (p_len, hunkmax, sizeof *p_len);
-  p_Char = xireallocarray (p_Char, hunkmax, sizeof *p_Char);
+  if (! p_line)
+    set_hunk_arrays (xinmalloc (hunkmax, HUNK_ENTRY_SIZE));
 }
 
-/* Enlarge the arrays containing the current hunk of patch. */
+/* Enlarge the arrays containing the current hunk of patch,
+   so that they have room for more than N entries.  */
 
 static void
-grow_hunkmax (void)
+grow_hunkmax (idx_t n)
 {
   assert (p_line && p_len && p_Char);
-  p_line = xpalloc (p_line, &hunkmax, 1, -1, sizeof *p_line);
-  p_len = xireallocarray (p_len, hunkmax, sizeof *p_len);
-  p_Char = xireallocarray (p_Char, hunkmax, sizeof *p_Char);
+  if (n < hunkmax)
+    return;
+  char **o_line = p_line;
+  idx_t *o_len = p_len;
+  char *o_Char = p_Char;
+  idx_t o_hunkmax = hunkmax;
+  set_hunk_arrays (xpalloc (nullptr, &hunkmax, n + 1 - hunkmax, -1,
+			    HUNK_ENTRY_SIZE));
+  memcpy (p_line, o_line, o_hunkmax * sizeof *p_line);
+  memcpy (p_len, o_len, o_hunkmax * sizeof *p_len);
+  memcpy (p_Char, o_Char, o_hunkmax * sizeof *p_Char);
+  free (o_line);
+}
+
+/* Discard the text of the current hunk.  */
+
+static void
+clear_hunk (void)
+{
+  if (p_hunk_base)
+    obstack_free (&p_hunk_stack, p_hunk_base);
+  else
+    {
+      obstack_init (&p_hunk_stack);
+      p_hunk_base = obstack_alloc (&p_hunk_stack, 0);
+    }
+  p_end = -1;
+  p_c_function = nullptr;
+  p_hashed = false;
 }
 
 static bool
@@ -221,7 +464,7 @@ maybe_reverse (char const *name, bool nonexistent, bool is_empty)
 bool
 there_is_another_patch (bool need_header, mode_t *file_type)
 {
-    if (p_base != 0 && p_base >= p_filesize) {
+    if (p_base != 0 && patch_eof (p_base)) {
 	if (verbosity == VERBOSE)
 	    say ("done\n");
 	return false;
@@ -234,13 +477,13 @@ there_is_another_patch (bool need_header, mode_t *file_type)
 	  say (p_base
 	       ? "  Ignoring the trailing garbage.\ndone\n"
 	       : "  I can't seem to find a patch in there anywhere.\n");
-	if (! p_base && p_filesize)
+	if (! p_base && ! patch_eof (0))
 	  fatal ("Only garbage was found in the patch input.");
 	return false;
     }
     if (skip_rest_of_patch)
       {
-	Fseeko (pfp, p_start, SEEK_SET);
+	p_pos = p_start;
 	p_input_line = p_sline - 1;
 	return true;
       }
@@ -484,6 +727,7 @@ intuit_diff_type (bool need_header, mode_t *p_file_type)
 	  p_sha1[i] = 0;
 	}
     p_git_diff = false;
+    p_no_hunks = false;
     for (i = OLD; i <= NEW; i++)
       {
 	p_mode[i] = 0;
@@ -502,7 +746,7 @@ intuit_diff_type (bool need_header, mode_t *p_file_type)
     p_timestamp[OLD].tv_sec = p_timestamp[NEW].tv_sec = -1;
     p_timestamp[OLD].tv_nsec = p_timestamp[NEW].tv_nsec = -1;
     p_says_nonexistent[OLD] = p_says_nonexistent[NEW] = 0;
-    Fseeko (pfp, p_base, SEEK_SET);
+    p_pos = p_base;
     p_input_line = p_bline - 1;
     for (;;) {
 	char *s;
@@ -515,7 +759,7 @@ intuit_diff_type (bool need_header, mode_t *p_file_type)
 	bool strip_trailing_cr;
 
 	indent = 0;
-	this_line = Ftello (pfp);
+	this_line = p_pos;
 	idx_t chars_read = pget_line (0, 0, false, false, false);
 	if (! chars_read) {
 	    if (first_ed_command_letter) {
@@ -532,6 +776,7 @@ intuit_diff_type (bool need_header, mode_t *p_file_type)
 		  {
 		    /* Patch contains no hunks; any diff type will do. */
 		    retval = UNI_DIFF;
+		    p_no_hunks = true;
 		    goto scan_exit;
 		  }
 		return NO_DIFF;
@@ -625,6 +870,7 @@ intuit_diff_type (bool need_header, mode_t *p_file_type)
 		p_sline = p_input_line;
 		/* Patch contains no hunks; any diff type will do. */
 		retval = UNI_DIFF;
+		p_no_hunks = true;
 		goto scan_exit;
 	      }
 
@@ -808,9 +1054,9 @@ intuit_diff_type (bool need_header, mode_t *p_file_type)
 		 appear to have been deleted.  */
 	      off_t saved_p_base = p_base;
 	      idx_t saved_p_bline = p_bline;
-	      Fseeko (pfp, previous_line, SEEK_SET);
+	      p_pos = previous_line;
 	      p_input_line -= 2;
-	      if (another_hunk (retval, false)
+	      if (read_hunk (retval, false)
 		  && ! p_repl_lines && p_newfirst == 1)
 		p_says_nonexistent[NEW] = 1 + ! p_timestamp[NEW].tv_sec;
 	      next_intuit_at (saved_p_base, saved_p_bline);
@@ -1105,6 +1351,64 @@ next_intuit_at (off_t file_pos, idx_t file_line)
 {
     p_base = file_pos;
     p_bline = file_line;
+    p_keep = file_pos;
+}
+
+/* Return where in the patch file the next patch will be looked for,
+   and set *LINE to the line number there.  */
+
+off_t
+patch_position (idx_t *line)
+{
+    *line = p_bline;
+    return p_base;
+}
+
+/* Look for the next patch at FILE_POS in the patch file, which is at
+   line FILE_LINE.  */
+
+void
+set_patch_position (off_t file_pos, idx_t file_line)
+{
+    next_intuit_at (file_pos, file_line);
+}
+
+/* Guess the name of the file that the next patch is to, from the first
+   header line within a few lines of where the next patch will be looked
+   for.  Look only at patch data already read.  Return the name, which
+   the caller should free, or null if there is no guess.  */
+
+char *
+next_patch_name (void)
+{
+    if (p_base < p_bufpos)
+      return nullptr;
+
+    char const *s = p_buf + (p_base - p_bufpos);
+    char const *lim = p_buf + p_buflen;
+    char *name = nullptr;
+
+    for (int i = 0; ! name && i < 16 && s < lim; i++)
+      {
+	char const *nl = memchr (s, '\n', lim - s);
+	if (! nl)
+	  break;
+	char *line = ximemdup0 (s, nl + 1 - s);
+	char const *u;
+	struct timespec stamp;
+
+	if ((strnEQ (line, "---", 3) || strnEQ (line, "+++", 3)
+	     || strnEQ (line, "***", 3))
+	    && c_isblank (line[3]))
+	  fetchname (line + 4, strippath, &name, nullptr, &stamp);
+	else if (strnEQ (line, "Index:", 6))
+	  fetchname (line + 6, strippath, &name, nullptr, nullptr);
+	else if (strnEQ (line, "diff --git ", 11))
+	  name = parse_name (line + 11, strippath, &u);
+	free (line);
+	s = nl + 1;
+      }
+    return name;
 }
 
 /* Basically a verbose fseek() to the actual diff listing. */
@@ -1112,32 +1416,29 @@ next_intuit_at (off_t file_pos, idx_t file_line)
 static void
 skip_to (off_t file_pos, idx_t file_line)
 {
-    FILE *i = pfp;
     FILE *o = stdout;
-    int c;
 
     assert(p_base <= file_pos);
     if ((verbosity == VERBOSE || !inname) && p_base < file_pos) {
-	Fseeko (i, p_base, SEEK_SET);
+	p_pos = p_base;
 	say ("The text leading up to this was:\n--------------------------\n");
 
-	while (Ftello (i) < file_pos)
+	while (p_pos < file_pos)
 	  {
+	    char const *lim;
+	    char const *line = patch_line_at (p_pos, &lim);
+	    char const *nl = memchr (line, '\n', lim - line);
+	    if (! nl)
+	      read_fatal ();
 	    Fputc ('|', o);
-	    do
-	      {
-		c = getc (i);
-		if (c < 0)
-		  read_fatal ();
-		Fputc (c, o);
-	      }
-	    while (c != '\n');
+	    Fwrite (line, 1, nl + 1 - line, o);
+	    p_pos += nl + 1 - line;
 	  }
 
 	say ("--------------------------\n");
     }
     else
-	Fseeko (i, file_pos, SEEK_SET);
+	p_pos = file_pos;
     p_input_line = file_line - 1;
 }
 
@@ -1191,32 +1492,28 @@ scan_linenum (char *string, idx_t *linenum)
 
 bool
 another_hunk (enum diff difftype, bool rev)
+{
+  /* Nothing before this hunk will be read again.  */
+  p_keep = p_pos;
+
+  return read_hunk (difftype, rev);
+}
+
+/* Read the next hunk of the current diff listing, like another_hunk.
+   Intuition uses this directly, as it may need to look back further.  */
+
+static bool
+read_hunk (enum diff difftype, bool rev)
 {
     char *s;
     idx_t context = 0;
 
     set_hunkmax();
-
-    while (p_end >= 0) {
-	if (p_end == p_efake)
-	    p_end = p_bfake;		/* don't free twice */
-	else
-	    free(p_line[p_end]);
-	p_end--;
-    }
-    assert (p_end < 0);
-    p_efake = -1;
-
-    if (p_c_function)
-      {
-	free (p_c_function);
-	p_c_function = nullptr;
-      }
+    clear_hunk ();
 
     p_max = hunkmax;			/* gets reduced when --- found */
     if (difftype == CONTEXT_DIFF || difftype == NEW_CONTEXT_DIFF) {
-	off_t line_beginning = Ftello (pfp);
-					/* file pos of the current line */
+	off_t line_beginning = p_pos;	/* file pos of the current line */
 	idx_t repl_beginning = 0;	/* index of --- line */
 	idx_t fillcnt = 0;	/* #lines of missing ptrn or repl */
 	idx_t fillsrc;		/* index of first line to copy */
@@ -1254,7 +1551,8 @@ another_hunk (enum diff difftype, bool rev)
 	    p_c_function = s;
 	    while (*s != '\n')
 		s++;
-	    p_c_function = ximemdup0 (p_c_function, s - p_c_function);
+	    p_c_function = obstack_copy0 (&p_hunk_stack, p_c_function,
+					  s - p_c_function);
 	  }
 	p_hunk_beg = p_input_line + 1;
 	while (p_end < p_max) {
@@ -1302,7 +1600,7 @@ another_hunk (enum diff difftype, bool rev)
 		}
 		context = 0;
 		p_len[p_end] = strlen (patchbuf);
-		p_line[p_end] = xmemdup (patchbuf, p_len[p_end] + 1);
+		p_line[p_end] = hunk_copy (patchbuf, p_len[p_end] + 1);
 		for (s = patchbuf; *s && !c_isdigit (*s); s++)
 		  /* do nothing */ ;
 		s = scan_linenum (s, &p_first);
@@ -1325,8 +1623,7 @@ another_hunk (enum diff difftype, bool rev)
 		    || p_ptrn_lines >= IDX_MAX - 6)
 		  malformed ();
 		p_max = p_ptrn_lines + 6;	/* we need this much at least */
-		while (p_max + 1 >= hunkmax)
-		  grow_hunkmax ();
+		grow_hunkmax (p_max + 1);
 		p_max = hunkmax;
 		break;
 	    case '-':
@@ -1369,11 +1666,11 @@ another_hunk (enum diff difftype, bool rev)
 		      }
 		  }
 		repl_beginning = p_end;
-		repl_backtrack_position = Ftello (pfp);
+		repl_backtrack_position = p_pos;
 		repl_patch_line = p_input_line;
 		repl_context = context;
 		p_len[p_end] = strlen (patchbuf);
-		p_line[p_end] = xmemdup (patchbuf, p_len[p_end] + 1);
+		p_line[p_end] = hunk_copy (patchbuf, p_len[p_end] + 1);
 		p_Char[p_end] = '=';
 		for (s = patchbuf; *s && !c_isdigit (*s); s++)
 		  /* do nothing */ ;
@@ -1397,8 +1694,7 @@ another_hunk (enum diff difftype, bool rev)
 		    || p_repl_lines >= IDX_MAX - p_end)
 		  malformed ();
 		p_max = p_repl_lines + p_end;
-		while (p_max + 1 >= hunkmax)
-		  grow_hunkmax ();
+		grow_hunkmax (p_max + 1);
 		if (p_repl_lines != ptrn_copiable
 		    && (p_prefix_context != 0
 			|| context != 0
@@ -1414,6 +1710,7 @@ another_hunk (enum diff difftype, bool rev)
 		if (*s == '\n' && canonicalize_ws) {
 		    strcpy (s, " \n");
 		    chars_read = 2;
+		    p_src = nullptr;
 		}
 		if (c_isblank (*s)) {
 		    s++;
@@ -1437,7 +1734,7 @@ another_hunk (enum diff difftype, bool rev)
 		   && p_end == (repl_beginning ? p_max : p_ptrn_lines)
 		   && incomplete_line ());
 		p_len[p_end] = chars_read;
-		p_line[p_end] = savebuf (s, chars_read);
+		p_line[p_end] = hunk_line (s, chars_read);
 		context = 0;
 		break;
 	    case '\t': case '\n':	/* assume spaces got eaten */
@@ -1456,7 +1753,7 @@ another_hunk (enum diff difftype, bool rev)
 		   && p_end == (repl_beginning ? p_max : p_ptrn_lines)
 		   && incomplete_line ());
 		p_len[p_end] = chars_read;
-		p_line[p_end] = savebuf (patchbuf, chars_read);
+		p_line[p_end] = hunk_line (patchbuf, chars_read);
 		if (p_end != p_ptrn_lines + 1) {
 		    ptrn_spaces_eaten |= (repl_beginning != 0);
 		    some_context = true;
@@ -1474,6 +1771,7 @@ another_hunk (enum diff difftype, bool rev)
 		if (*s == '\n' && canonicalize_ws) {
 		    strcpy (s, "\n");
 		    chars_read = 2;
+		    p_src = nullptr;
 		}
 		if (c_isblank (*s)) {
 		    s++;
@@ -1493,7 +1791,7 @@ another_hunk (enum diff difftype, bool rev)
 		   && p_end == (repl_beginning ? p_max : p_ptrn_lines)
 		   && incomplete_line ());
 		p_len[p_end] = chars_read;
-		p_line[p_end] = savebuf (s, chars_read);
+		p_line[p_end] = hunk_line (s, chars_read);
 		break;
 	    default:
 		if (repl_beginning && repl_could_be_missing) {
@@ -1513,9 +1811,7 @@ another_hunk (enum diff difftype, bool rev)
 	    /* reset state back to just after --- */
 	    p_input_line = repl_patch_line;
 	    context = repl_context;
-	    for (p_end--; p_end > repl_beginning; p_end--)
-		free(p_line[p_end]);
-	    Fseeko (pfp, repl_backtrack_position, SEEK_SET);
+	    p_pos = repl_backtrack_position;
 
 	    /* redundant 'new' context lines were omitted - set */
 	    /* up to fill them in from the old file context */
@@ -1569,8 +1865,6 @@ another_hunk (enum diff difftype, bool rev)
 
 	/* if there were omitted context lines, fill them in now */
 	if (fillcnt) {
-	    p_bfake = filldst;		/* remember where not to free() */
-	    p_efake = filldst + fillcnt - 1;
 	    while (fillcnt-- > 0) {
 		while (fillsrc <= p_end && fillsrc != repl_beginning
 		       && p_Char[fillsrc] != ' ')
@@ -1600,7 +1894,7 @@ another_hunk (enum diff difftype, bool rev)
 	}
     }
     else if (difftype == UNI_DIFF) {
-	off_t line_beginning = Ftello (pfp); /* file pos of the current line */
+	off_t line_beginning = p_pos;	/* file pos of the current line */
 
 	idx_t fillsrc;	/* index of old lines */
 	idx_t filldst;	/* index of new lines */
@@ -1644,7 +1938,8 @@ another_hunk (enum diff difftype, bool rev)
 	    p_c_function = s;
 	    while (*s != '\n')
 		s++;
-	    p_c_function = ximemdup0 (p_c_function, s - p_c_function);
+	    p_c_function = obstack_copy0 (&p_hunk_stack, p_c_function,
+					  s - p_c_function);
 	  }
 	if (!p_ptrn_lines)
 	    p_first++;			/* do append rather than insert */
@@ -1653,18 +1948,17 @@ another_hunk (enum diff difftype, bool rev)
 	if (p_ptrn_lines >= IDX_MAX - (p_repl_lines + 1))
 	  malformed ();
 	p_max = p_ptrn_lines + p_repl_lines + 1;
-	while (p_max + 1 >= hunkmax)
-	  grow_hunkmax ();
+	grow_hunkmax (p_max + 1);
 	fillsrc = 1;
 	filldst = fillsrc + p_ptrn_lines;
 	p_end = filldst + p_repl_lines;
 	p_len[0] = sprintf (patchbuf, "*** %td,%td ****\n",
 			    p_first, p_first + p_ptrn_lines - 1);
-	p_line[0] = xmemdup (patchbuf, p_len[0] + 1);
+	p_line[0] = hunk_copy (patchbuf, p_len[0] + 1);
 	p_Char[0] = '*';
 	p_len[filldst] = sprintf (patchbuf, "--- %td,%td ----\n",
 				  p_newfirst, p_newfirst + p_repl_lines - 1);
-	p_line[filldst] = xmemdup (patchbuf, p_len[filldst] + 1);
+	p_line[filldst] = hunk_copy (patchbuf, p_len[filldst] + 1);
 	p_Char[filldst++] = '=';
 	p_prefix_context = -1;
 	p_hunk_beg = p_input_line + 1;
@@ -1681,19 +1975,16 @@ another_hunk (enum diff difftype, bool rev)
 	    }
 	    if (*patchbuf == '\t' || *patchbuf == '\n') {
 		ch = ' ';		/* assume the space got eaten */
-		s = savebuf (patchbuf, chars_read);
+		s = hunk_line (patchbuf, chars_read);
 	    }
 	    else {
 		ch = *patchbuf;
-		s = savebuf (patchbuf+1, --chars_read);
+		s = hunk_line (patchbuf+1, --chars_read);
 	    }
 	    switch (ch) {
 	    case '-':
-		if (fillsrc > p_ptrn_lines) {
-		    free(s);
-		    p_end = filldst-1;
-		    malformed ();
-		}
+		if (fillsrc > p_ptrn_lines)
+		  malformed ();
 		chars_read -= fillsrc == p_ptrn_lines && incomplete_line ();
 		p_Char[fillsrc] = ch;
 		p_line[fillsrc] = s;
@@ -1703,36 +1994,23 @@ another_hunk (enum diff difftype, bool rev)
 		ch = ' ';
 		FALLTHROUGH;
 	    case ' ':
-		if (fillsrc > p_ptrn_lines) {
-		    free(s);
-		    while (--filldst > p_ptrn_lines)
-			free(p_line[filldst]);
-		    p_end = fillsrc-1;
-		    malformed ();
-		}
+		if (fillsrc > p_ptrn_lines)
+		  malformed ();
 		context++;
 		chars_read -= fillsrc == p_ptrn_lines && incomplete_line ();
 		p_Char[fillsrc] = ch;
 		p_line[fillsrc] = s;
 		p_len[fillsrc++] = chars_read;
-		s = savebuf (s, chars_read);
 		FALLTHROUGH;
 	    case '+':
-		if (filldst > p_end) {
-		    free(s);
-		    while (--filldst > p_ptrn_lines)
-			free(p_line[filldst]);
-		    p_end = fillsrc-1;
-		    malformed ();
-		}
+		if (filldst > p_end)
+		  malformed ();
 		chars_read -= filldst == p_end && incomplete_line ();
 		p_Char[filldst] = ch;
 		p_line[filldst] = s;
 		p_len[filldst++] = chars_read;
 		break;
 	    default:
-		p_end = filldst;
-		free (s);
 		malformed ();
 	    }
 	    if (ch != ' ') {
@@ -1745,10 +2023,16 @@ another_hunk (enum diff difftype, bool rev)
 	  malformed ();
 	p_suffix_context = context;
     }
+    else if (difftype == GIT_BINARY_DIFF) {
+	/* apply_binary_patch reads the data; skip it if it did not.  */
+	if (p_base <= p_start)
+	  next_intuit_at (p_start, p_sline);
+	return false;
+    }
     else {				/* normal diff--fake it up */
 	char hunk_type;
 	idx_t min, max;
-	off_t line_beginning = Ftello (pfp);
+	off_t line_beginning = p_pos;
 
 	p_prefix_context = p_suffix_context = 0;
 	idx_t chars_read = get_line (false);
@@ -1790,11 +2074,10 @@ another_hunk (enum diff difftype, bool rev)
 	if (p_ptrn_lines >= IDX_MAX - (p_repl_lines + 1))
 	  malformed ();
 	p_end = p_ptrn_lines + p_repl_lines + 1;
-	while (p_end + 1 >= hunkmax)
-	  grow_hunkmax ();
+	grow_hunkmax (p_end + 1);
 	p_len[0] = sprintf (patchbuf, "*** %td,%td\n",
 			    p_first, p_first + p_ptrn_lines - 1);
-	p_line[0] = xmemdup (patchbuf, p_len[0] + 1);
+	p_line[0] = hunk_copy (patchbuf, p_len[0] + 1);
 	p_Char[0] = '*';
 
 	idx_t i;
@@ -1809,7 +2092,7 @@ another_hunk (enum diff difftype, bool rev)
 		     p_input_line);
 	    chars_read -= 2 + (i == p_ptrn_lines && incomplete_line ());
 	    p_len[i] = chars_read;
-	    p_line[i] = savebuf (patchbuf + 2, chars_read);
+	    p_line[i] = hunk_line (patchbuf + 2, chars_read);
 	    p_Char[i] = '-';
 	}
 	if (hunk_type == 'c') {
@@ -1821,7 +2104,7 @@ another_hunk (enum diff difftype, bool rev)
 	      fatal ("'---' expected at line %td of patch", p_input_line);
 	}
 	p_len[i] = sprintf (patchbuf, "--- %td,%td\n", min, max);
-	p_line[i] = xmemdup (patchbuf, p_len[i] + 1);
+	p_line[i] = hunk_copy (patchbuf, p_len[i] + 1);
 	p_Char[i] = '=';
 	for (i++; i<=p_end; i++) {
 	    chars_read = get_line (true);
@@ -1834,7 +2117,7 @@ another_hunk (enum diff difftype, bool rev)
 		     p_input_line);
 	    chars_read -= 2 + (i == p_end && incomplete_line ());
 	    p_len[i] = chars_read;
-	    p_line[i] = savebuf (patchbuf + 2, chars_read);
+	    p_line[i] = hunk_line (patchbuf + 2, chars_read);
 	    p_Char[i] = '+';
 	}
     }
@@ -1890,25 +2173,29 @@ static idx_t
 pget_line (idx_t indent, ptrdiff_t rfc934_nesting, bool strip_trailing_cr,
 	   bool pass_comments_through, bool allow_nul)
 {
-  FILE *fp = pfp;
-  int c;
+  off_t pos = p_pos;
+  char const *line;
+  char const *p;
+  char const *lim;
+  unsigned char c;
   idx_t i;
   char *b;
-  int invalid_byte = allow_nul ? -1 : 0;
+  char const *src;
   bool got_invalid_byte = false;
 
   do
     {
+      line = p = patch_line_at (pos, &lim);
       i = 0;
       for (;;)
 	{
-	  c = getc (fp);
-	  if (c < 0)
+	  if (p == lim)
 	    {
-	      if (ferror (fp))
-		read_fatal ();
+	      p_pos = pos + (p - line);
+	      p_src = nullptr;
 	      return 0;
 	    }
+	  c = *p++;
 	  if (indent <= i)
 	    break;
 	  if (c == ' ' || c == 'X')
@@ -1916,47 +2203,50 @@ pget_line (idx_t indent, ptrdiff_t rfc934_nesting, bool strip_trailing_cr,
 	  else if (c == '\t')
 	    i = (i + 8) & ~7;
 	  else
-	    got_invalid_byte |= c == invalid_byte;
+	    got_invalid_byte |= c == '\0' && !allow_nul;
 	}
 
       i = 0;
       b = patchbuf;
+      src = p - 1;
 
       while (c == '-' && 0 <= --rfc934_nesting)
 	{
-	  c = getc (fp);
-	  if (c < 0)
+	  if (p == lim)
 	    goto patch_ends_in_middle_of_line;
+	  c = *p++;
 	  if (c != ' ')
 	    {
 	      i = 1;
 	      b[0] = '-';
-	      got_invalid_byte |= c == invalid_byte;
+	      got_invalid_byte |= c == '\0' && !allow_nul;
 	      break;
 	    }
-	  c = getc (fp);
-	  if (c < 0)
+	  if (p == lim)
 	    goto patch_ends_in_middle_of_line;
+	  c = *p++;
+	  src = p - 1;
 	}
 
-      idx_t s = patchbufsize;
-
-      for (;;)
+      /* Copy the rest of the line, which starts with C, in one go.  */
+      char const *rest = p - 1;
+      char const *nl = memchr (rest, '\n', lim - rest);
+      if (! nl)
 	{
-	  if (i == s - 1)
-	    {
-	      grow_patchbuf ();
-	      b = patchbuf;
-	      s = patchbufsize;
-	    }
-	  b[i++] = c;
-	  if (c == '\n')
-	    break;
-	  got_invalid_byte |= c == invalid_byte;
-	  c = getc (fp);
-	  if (c < 0)
-	    goto patch_ends_in_middle_of_line;
+	  p = lim;
+	  goto patch_ends_in_middle_of_line;
+	}
+      idx_t restlen = nl + 1 - rest;
+      while (patchbufsize - i <= restlen)
+	{
+	  grow_patchbuf ();
+	  b = patchbuf;
 	}
+      memcpy (b + i, rest, restlen);
+      i += restlen;
+      got_invalid_byte |= !allow_nul && memchr (rest, '\0', restlen);
+      p = nl + 1;
+      pos += p - line;
 
       p_input_line++;
     }
@@ -1965,42 +2255,58 @@ pget_line (idx_t indent, ptrdiff_t rfc934_nesting, bool strip_trailing_cr,
   if (got_invalid_byte)
     fatal ("patch line %td contains NUL byte", p_input_line);
 
+  p_pos = pos;
+
+  /* Streamed data does not stay put, so hunk lines cannot point into it.  */
+  p_src = p_stream_fd < 0 ? src : nullptr;
   if (strip_trailing_cr && 2 <= i && b[i - 2] == '\r')
-    b[i-- - 2] = '\n';
+    {
+      b[i-- - 2] = '\n';
+      p_src = nullptr;
+    }
   b[i] = '\0';
   return i;
 
  patch_ends_in_middle_of_line:
-  if (ferror (fp))
-    read_fatal ();
+  p_pos = pos + (p - line);
+  p_src = nullptr;
   say ("patch unexpectedly ends in middle of line\n");
   return 0;
 }
 
+/* Return the N bytes at S, which lie within patchbuf, as hunk line text.
+   Point into the patch itself if the line most recently read is there
+   unchanged; otherwise, return a copy.  */
+
+static char *
+hunk_line (char const *s, idx_t n)
+{
+  return p_src ? (char *) p_src + (s - patchbuf) : hunk_copy (s, n);
+}
+
+/* Return a copy of the N bytes at S that lasts until the next hunk.  */
+
+static char *
+hunk_copy (char const *s, idx_t n)
+{
+  return obstack_copy (&p_hunk_stack, s, n);
+}
+
+/* If the next line of the patch is a "\ No newline at end of file"
+   marker, skip it and return true.  */
+
 static bool
 incomplete_line (void)
 {
-  FILE *fp = pfp;
-  int c;
-  off_t line_beginning = Ftello (fp);
+  char const *lim;
+  char const *p = patch_line_at (p_pos, &lim);
 
-  if (getc (fp) == '\\')
-    {
-      while ((c = getc (fp)) != '\n')
-	if (c < 0)
-	  {
-	    if (ferror (fp))
-	      read_fatal ();
-	    break;
-	  }
-      return true;
-    }
-  else
-    {
-      /* We don't trust ungetc.  */
-      Fseeko (pfp, line_beginning, SEEK_SET);
-      return false;
-    }
+  if (p == lim || *p != '\\')
+    return false;
+
+  char const *nl = memchr (p, '\n', lim - p);
+  p_pos += (nl ? nl + 1 : lim) - p;
+  return true;
 }
 
 /* Reverse the old and new portions of the current hunk. */
@@ -2035,11 +2341,6 @@ pch_swap (void)
 	blankline = true;
 	i++;
     }
-    if (p_efake >= 0) {			/* fix non-freeable ptr range */
-	ptrdiff_t n = p_efake <= i ? p_end - p_ptrn_lines : -i;
-	p_efake += n;
-	p_bfake += n;
-    }
     idx_t n;
     for (n=0; i <= p_end; i++,n++) {
 	p_line[n] = tp_line[i];
@@ -2080,9 +2381,8 @@ pch_swap (void)
     p_ptrn_lines = p_repl_lines;
     p_repl_lines = i;
     p_Char[p_end + 1] = '^';
+    p_hashed = false;
     free (tp_line);
-    free (tp_len);
-    free (tp_char);
 }
 
 /* Return whether file WHICH (false = old, true = new) appears to nonexistent.
@@ -2110,6 +2410,14 @@ bool pch_rename (void)
   return p_rename[OLD] && p_rename[NEW];
 }
 
+/* Does this patch only have headers, with no hunks?  */
+
+bool
+pch_no_hunks (void)
+{
+  return p_no_hunks;
+}
+
 /* Return the specified line position in the old file of the old context. */
 
 idx_t
@@ -2184,6 +2492,19 @@ pch_char (idx_t line)
     return p_Char[line];
 }
 
+/* Return the hash_line of a particular patch line.  */
+
+uint_least32_t
+pch_line_hash (idx_t line)
+{
+    if (!p_hashed) {
+	for (idx_t i = 0; i <= p_end; i++)
+	    p_hash[i] = hash_line (p_line[i], p_len[i]);
+	p_hashed = true;
+    }
+    return p_hash[line];
+}
+
 /* Return a pointer to a particular patch line. */
 
 char *
@@ -2238,6 +2559,114 @@ pch_mode (bool which)
   return p_mode[which];
 }
 
+char const *
+pch_sha1 (bool which)
+{
+  return p_sha1[which];
+}
+
+/* Read up to the data of a hunk of a git binary diff: the first hunk if
+   not REV, and the second (which undoes the first) otherwise.  Return
+   the size of the data after inflating it, and set *DELTA to whether
+   the data is a delta rather than literal.  Return -1 if REV and there
+   is no second hunk.  */
+
+intmax_t
+pch_binary_hunk (bool rev, bool *delta)
+{
+  if (! get_line (false) || ! strnEQ (patchbuf, "GIT binary patch", 16))
+    malformed ();
+
+  for (int hunk = 0; ; hunk++)
+    {
+      /* A diff need not have a second hunk.  */
+      bool got_line = get_line (false);
+      char const *s = patchbuf;
+      bool d = got_line && strnEQ (s, "delta ", 6);
+      if (! d && ! (got_line && strnEQ (s, "literal ", 8)))
+	{
+	  if (hunk)
+	    return -1;
+	  malformed ();
+	}
+      s += d ? 6 : 8;
+      if (! c_isdigit (*s))
+	malformed ();
+      intmax_t size = 0;
+      for (; c_isdigit (*s); s++)
+	if (ckd_mul (&size, size, 10) || ckd_add (&size, size, *s - '0'))
+	  malformed ();
+      if (*s != '\n')
+	malformed ();
+
+      if (hunk == rev)
+	{
+	  *delta = d;
+	  return size;
+	}
+      char buf[52];
+      while (pch_binary_line (buf))
+	continue;
+    }
+}
+
+/* Decode the next line of data in a hunk of a git binary diff into
+   BUF, which must have room for 52 bytes, and return the number of
+   bytes.  Return 0 at the blank line that ends the data.  */
+
+int
+pch_binary_line (char *buf)
+{
+  static signed char const base85[] = {
+    ['0'] =  1,  2,  3,  4,  5,  6,  7,  8,  9, 10,
+    ['A'] = 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23,
+	    24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36,
+    ['a'] = 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49,
+	    50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62,
+    ['!'] = 63, ['#'] = 64, 65, 66, 67, ['('] = 68, 69, 70, 71,
+    ['-'] = 72, [';'] = 73, 74, 75, 76, 77, 78,
+    ['^'] = 79, 80, 81, ['{'] = 82, 83, 84, 85
+  };
+
+  off_t beginning_of_this_line = p_pos;
+  idx_t chars_read = get_line (false);
+  if (! chars_read || strEQ (patchbuf, "\n"))
+    {
+      next_intuit_at (chars_read ? p_pos : beginning_of_this_line,
+		      p_input_line + !!chars_read);
+      return 0;
+    }
+
+  /* The first character gives the number of bytes, 1 through 52,
+     which are then encoded in base 85, four bytes in five characters.  */
+  unsigned char const *s = (unsigned char const *) patchbuf;
+  int len = (c_isupper (*s) ? *s - 'A' + 1
+	     : c_islower (*s) ? *s - 'a' + 27
+	     : 0);
+  if (! len || chars_read != 1 + (len + 3) / 4 * 5 + 1)
+    malformed ();
+  s++;
+
+  for (int i = 0; i < len; i += 4)
+    {
+      uint_least32_t acc = 0;
+      for (int j = 0; j < 5; j++)
+	{
+	  int digit = *s < sizeof base85 ? base85[*s] - 1 : -1;
+	  s++;
+	  if (digit < 0
+	      || (j == 4 && (0xffffffff / 85 < acc
+			     || 0xffffffff - digit < acc * 85)))
+	    malformed ();
+	  acc = acc * 85 + digit;
+	}
+      for (int j = 0; j < 4 && i + j < len; j++)
+	buf[i + j] = acc >> (24 - 8 * j);
+    }
+
+  return len;
+}
+
 /* Is the newline-terminated line a valid 'ed' command for patch
    input?  If so, return the command character; if not, return 0.
    This accepts just a subset of the valid commands, but it's
@@ -2301,62 +2730,212 @@ get_ed_command_letter (char const *line)
 # pragma GCC diagnostic ignored "-Wanalyzer-fd-leak"
 #endif
 
-/* Apply an ed script by feeding ed itself. */
+/* Parse a line number at *PP, advancing *PP past it.
+   Return -1 if the number is too large.  */
 
-void
-do_ed_script (char *input_name, struct outfile *output, FILE *ofp)
+static idx_t
+ed_line_number (char const **pp)
 {
-    char const *output_name = output->name;
-    off_t beginning_of_this_line;
-    FILE *tmpfp = 0;
-    int tmpfd = -1; /* placate gcc's -Wmaybe-uninitialized */
+  char const *p = *pp;
+  idx_t n = 0;
+  bool overflow = false;
 
-    if (! dry_run && ! skip_rest_of_patch)
-      {
-	/* Write ed script to a temporary file.  This causes ed to abort on
-	   invalid commands such as when line numbers or ranges exceed the
-	   number of available lines.  When ed reads from a pipe, it rejects
-	   invalid commands and treats the next line as a new command, which
-	   can lead to arbitrary command execution.  */
-
-	tmpfd = make_tempfile (&tmped, 'e', nullptr, O_RDWR | O_BINARY, 0);
-	if (tmpfd < 0)
-	  pfatal ("Can't create temporary file %s", quotearg (tmped.name));
-	tmpfp = fdopen (tmpfd, "w+b");
-	if (! tmpfp)
-	  pfatal ("Can't open stream for file %s", quotearg (tmped.name));
-      }
+  for (; c_isdigit (*p); p++)
+    overflow |= (ckd_mul (&n, n, 10) || ckd_add (&n, n, *p - '0'));
+  *pp = p;
+  return overflow ? -1 : n;
+}
+
+/* Append SIZE bytes at BUF to the saved ed script.  */
+
+static void
+save_ed_script (char const *buf, idx_t size)
+{
+  if (ed_script_size - ed_script_used < size)
+    ed_script = xpalloc (ed_script, &ed_script_size,
+			 size - (ed_script_size - ed_script_used), -1, 1);
+  memcpy (ed_script + ed_script_used, buf, size);
+  ed_script_used += size;
+}
+
+/* Read an ed script from the patch file, saving it for do_ed_script.
+   Also record its changes for ed_change, and return true if they are
+   all that the script does.  This is so for scripts like those that
+   'diff -e' generates: addressed a, i, c and d commands in descending
+   order of line number that do not overlap, with text that is always
+   terminated by '.'.  A text line that is itself '.' is written as
+   '..' followed by an unaddressed 's/.//' and 'a' to continue.  */
+
+bool
+read_ed_script (void)
+{
+    bool simple = true;
+    idx_t limit = IDX_MAX;	/* first input line of the previous change */
+    ptrdiff_t current = -1;	/* change whose last text line is current */
+
+    ed_script_used = ed_nchanges = ed_nlines = ed_max_address = 0;
 
     for (;;) {
 	char ed_command_letter;
-	beginning_of_this_line = Ftello (pfp);
+	off_t beginning_of_this_line = p_pos;
 	idx_t chars_read = get_line (false);
 	if (! chars_read) {
 	    next_intuit_at(beginning_of_this_line,p_input_line);
 	    break;
 	}
 	ed_command_letter = get_ed_command_letter (patchbuf);
-	if (ed_command_letter) {
-	    if (tmpfp)
-	      Fwrite (patchbuf, 1, chars_read, tmpfp);
-	    if (ed_command_letter != 'd' && ed_command_letter != 's') {
-	        p_pass_comments_through = true;
-		while ((chars_read = get_line (true)) != 0) {
-		    if (tmpfp)
-		      Fwrite (patchbuf, 1, chars_read, tmpfp);
-		    if (chars_read == 2  &&  strEQ (patchbuf, ".\n"))
-			break;
+	if (! ed_command_letter) {
+	    next_intuit_at(beginning_of_this_line,p_input_line);
+	    break;
+	}
+	save_ed_script (patchbuf, chars_read);
+
+	if (simple) {
+	    char const *p = patchbuf;
+	    if (! c_isdigit (*p)) {
+		/* Continue the text of the current change.  */
+		if (current < 0)
+		  simple = false;
+		else if (ed_command_letter == 's') {
+		    struct ed_line *l = &ed_line[ed_nlines - 1];
+		    if (l->len == 1 || ed_script[l->offset] != '.')
+		      simple = false;
+		    else {
+			l->offset++;
+			l->len--;
+		    }
+		}
+		else if (ed_command_letter != 'a')
+		  simple = false;
+	    } else {
+		idx_t first = ed_line_number (&p);
+		idx_t last = first;
+		if (*p == ',') {
+		    p++;
+		    last = ed_line_number (&p);
 		}
-		p_pass_comments_through = false;
+		switch (ed_command_letter) {
+		  case 'a':
+		    last = first;
+		    first = first < IDX_MAX ? first + 1 : -1;
+		    break;
+		  case 'i':
+		    last = first - 1;
+		    break;
+		  case 'c': case 'd':
+		    if (last < first)
+		      first = -1;
+		    break;
+		  default:
+		    first = -1;
+		    break;
+		}
+		if (0 < first && first - 1 <= last && last < limit) {
+		    limit = first;
+		    if (ed_nchanges == ed_changes_alloc)
+		      ed_changes = xpalloc (ed_changes, &ed_changes_alloc, 1,
+					    -1, sizeof *ed_changes);
+		    current = ed_nchanges++;
+		    ed_changes[current] = (struct ed_change) {
+		      .first = first, .last = last, .text = ed_nlines
+		    };
+		    /* 'i' addresses the line before which it inserts.  */
+		    idx_t address = ed_command_letter == 'i' ? first : last;
+		    ed_max_address = MAX (ed_max_address, address);
+		}
+		else
+		  simple = false;
 	    }
 	}
-	else {
-	    next_intuit_at(beginning_of_this_line,p_input_line);
-	    break;
+
+	if (ed_command_letter != 'd' && ed_command_letter != 's') {
+	    bool terminated = false;
+	    p_pass_comments_through = true;
+	    while ((chars_read = get_line (true)) != 0) {
+		save_ed_script (patchbuf, chars_read);
+		if (chars_read == 2  &&  strEQ (patchbuf, ".\n")) {
+		    terminated = true;
+		    break;
+		}
+		if (simple) {
+		    if (ed_nlines == ed_lines_alloc)
+		      ed_line = xpalloc (ed_line, &ed_lines_alloc, 1, -1,
+					 sizeof *ed_line);
+		    ed_line[ed_nlines++] = (struct ed_line) {
+		      .offset = ed_script_used - chars_read, .len = chars_read
+		    };
+		    ed_changes[current].ntext++;
+		}
+	    }
+	    p_pass_comments_through = false;
+	    simple &= terminated;
+	    if (simple && ! ed_changes[current].ntext)
+	      current = -1;
 	}
+	else if (ed_command_letter == 'd')
+	  current = -1;
     }
-    if (!tmpfp)
-      return;
+
+    return simple;
+}
+
+/* Return the number of changes recorded by read_ed_script.  */
+
+idx_t
+ed_changes_count (void)
+{
+  return ed_nchanges;
+}
+
+/* Return the highest line address used by the changes recorded by
+   read_ed_script, or 0 if there are none.  */
+
+idx_t
+ed_last_address (void)
+{
+  return ed_max_address;
+}
+
+/* Return the Ith change recorded by read_ed_script, counting from 0
+   in script order.  */
+
+struct ed_change
+ed_change (idx_t i)
+{
+  return ed_changes[i];
+}
+
+/* Return the Ith text line of the ed script, and store its length
+   including the trailing newline into *LEN.  */
+
+char const *
+ed_text_line (idx_t i, idx_t *len)
+{
+  *len = ed_line[i].len;
+  return ed_script + ed_line[i].offset;
+}
+
+/* Apply the ed script read by read_ed_script by feeding ed itself. */
+
+void
+do_ed_script (char *input_name, struct outfile *output, FILE *ofp)
+{
+    char const *output_name = output->name;
+
+    /* Write ed script to a temporary file.  This causes ed to abort on
+       invalid commands such as when line numbers or ranges exceed the
+       number of available lines.  When ed reads from a pipe, it rejects
+       invalid commands and treats the next line as a new command, which
+       can lead to arbitrary command execution.  */
+
+    int tmpfd = make_tempfile (&tmped, 'e', nullptr, O_RDWR | O_BINARY, 0);
+    if (tmpfd < 0)
+      pfatal ("Can't create temporary file %s", quotearg (tmped.name));
+    FILE *tmpfp = fdopen (tmpfd, "w+b");
+    if (! tmpfp)
+      pfatal ("Can't open stream for file %s", quotearg (tmped.name));
+
+    Fwrite (ed_script, 1, ed_script_used, tmpfp);
     static char const w_q[] = { 'w', '\n', 'q', '\n' };
     Fwrite (w_q, 1, sizeof w_q, tmpfp);
     Fflush (tmpfp);
@@ -18,6 +18,15 @@
 
 enum nametype { OLD, NEW, INDEX, NONE };
 
+/* A change made by an ed script: input lines FIRST through LAST
+   (none if LAST is FIRST - 1) are replaced by the NTEXT text lines
+   of the script that start with line TEXT.  */
+struct ed_change
+{
+  idx_t first, last;
+  idx_t text, ntext;
+};
+
 /* General purpose buffer.  */
 extern char *patchbuf;
 
@@ -45,11 +54,24 @@ char pch_char (idx_t) ATTRIBUTE_PURE;
 bool another_hunk (enum diff, bool);
 char pch_says_nonexistent (bool) ATTRIBUTE_PURE;
 idx_t pch_line_len (idx_t) ATTRIBUTE_PURE;
+uint_least32_t pch_line_hash (idx_t);
 char *pch_name (enum nametype) ATTRIBUTE_PURE;
 bool pch_copy (void) ATTRIBUTE_PURE;
 bool pch_rename (void) ATTRIBUTE_PURE;
+bool pch_no_hunks (void) ATTRIBUTE_PURE;
+char const *pch_sha1 (bool) ATTRIBUTE_PURE;
+intmax_t pch_binary_hunk (bool, bool *);
+int pch_binary_line (char *);
+bool read_ed_script (void);
+idx_t ed_changes_count (void) ATTRIBUTE_PURE;
+struct ed_change ed_change (idx_t) ATTRIBUTE_PURE;
+idx_t ed_last_address (void) ATTRIBUTE_PURE;
+char const *ed_text_line (idx_t, idx_t *);
 void do_ed_script (char *, struct outfile *, FILE *);
 void open_patch_file (char const *);
+off_t patch_position (idx_t *);
+void set_patch_position (off_t, idx_t);
+char *next_patch_name (void);
 void re_patch (void);
 void pch_normalize (enum diff);
 
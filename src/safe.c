@@ -601,6 +601,57 @@ safe_open (char *pathname, int flags, mode_t mode)
   return openat (dirfd, pathname, flags, mode);
 }
 
+#ifdef O_TMPFILE
+/* Open an unnamed file in the directory where PATHNAME would be
+   created, as with open(dir, O_TMPFILE | FLAGS, MODE).  */
+int
+safe_open_tmpfile (char *pathname, int flags, mode_t mode)
+{
+  int dirfd = AT_FDCWD;
+
+  if (! unsafe)
+    {
+      dirfd = traverse_path (&pathname);
+      if (dirfd == DIRFD_INVALID)
+	return -1;
+    }
+
+  char *base = last_component (pathname);
+  if (base == pathname)
+    return openat (dirfd, ".", O_TMPFILE | flags, mode);
+  char *dir = ximemdup0 (pathname, base - pathname);
+  int fd = openat (dirfd, dir, O_TMPFILE | flags, mode);
+  int err = errno;
+  free (dir);
+  errno = err;
+  return fd;
+}
+
+/* Give the unnamed file open as FD the name PATHNAME, which must not
+   exist yet.  Without permission to link the descriptor itself, link
+   the file through /proc instead.  */
+int
+safe_link_tmpfile (int fd, char *pathname)
+{
+  int dirfd = AT_FDCWD;
+
+  if (! unsafe)
+    {
+      dirfd = traverse_path (&pathname);
+      if (dirfd == DIRFD_INVALID)
+	return -1;
+    }
+
+  if (linkat (fd, "", dirfd, pathname, AT_EMPTY_PATH) == 0)
+    return 0;
+  if (errno != EPERM && errno != ENOENT)
+    return -1;
+  char procname[sizeof "/proc/self/fd/" + INT_STRLEN_BOUND (int)];
+  sprintf (procname, "/proc/self/fd/%d", fd);
+  return linkat (AT_FDCWD, procname, dirfd, pathname, AT_SYMLINK_FOLLOW);
+}
+#endif
+
 /* Replacement for rename() */
 int
 safe_rename (char *oldpath, char *newpath)
@@ -30,6 +30,10 @@ extern bool unsafe;
 int safe_stat (char *pathname, struct stat *buf);
 int safe_lstat (char *pathname, struct stat *buf);
 int safe_open (char *pathname, int flags, mode_t mode);
+#ifdef O_TMPFILE
+int safe_open_tmpfile (char *pathname, int flags, mode_t mode);
+int safe_link_tmpfile (int fd, char *pathname);
+#endif
 int safe_rename (char *oldpath, char *newpath);
 int safe_mkdir (char *pathname, mode_t mode);
 int safe_rmdir (char *pathname);
@@ -47,7 +47,6 @@
 enum backup_type backup_type;
 
 static void makedirs (char const *);
-static void Write (int, void const *, idx_t);
 
 typedef struct
 {
@@ -491,7 +490,9 @@ create_backup (char *to, const struct stat *to_st, bool leave_original)
 		pfatal ("Can't rename file %s to %s",
 			quotearg_n (0, to), quotearg_n (1, bakname));
 	    }
+	  dir_changed (to);
 	}
+      dir_changed (bakname);
       free (bakname);
     }
 }
@@ -559,6 +560,7 @@ move_file (struct outfile *outfrom, struct stat const *fromst,
 	  if (safe_lstat (to, &to_st) != 0)
 	    pfatal ("Can't get file attributes of %s %s", "symbolic link", to);
 	  insert_file_id (&to_st, CREATED);
+	  dir_changed (to);
 	}
       else
 	{
@@ -596,6 +598,7 @@ move_file (struct outfile *outfrom, struct stat const *fromst,
 		  copy_file (from, fromst, &(struct outfile) { .name = to },
 			     &tost, 0, mode, 0, to_dir_known_to_exist);
 		  insert_file_id (&tost, CREATED);
+		  dir_changed (to);
 		  return;
 		}
 
@@ -616,6 +619,8 @@ move_file (struct outfile *outfrom, struct stat const *fromst,
 	  undefer_signals ();
 
 	  insert_file_id (fromst, CREATED);
+	  dir_changed (from);
+	  dir_changed (to);
 	}
     }
   else if (! backup)
@@ -624,6 +629,7 @@ move_file (struct outfile *outfrom, struct stat const *fromst,
 	say ("Removing file %s\n", quotearg (to));
       if (safe_unlink (to) != 0 && errno != ENOENT)
 	pfatal ("Can't remove file %s", quotearg (to));
+      dir_changed (to);
     }
 }
 
@@ -656,6 +662,19 @@ create_file (struct outfile *out, int open_flags, mode_t mode,
   return fd;
 }
 
+/* Copy the rest of the file FROMFD to TOFD.  Have the kernel copy the
+   data if it can, which on some file systems shares their storage
+   instead, and read and write whatever it cannot.  */
+
+void
+copy_fd (int fromfd, int tofd)
+{
+  while (0 < copy_file_range (fromfd, nullptr, tofd, nullptr, 1 << 30, 0))
+    continue;
+  for (idx_t i; 0 < (i = Read (fromfd, patchbuf, patchbufsize)); )
+    Write (tofd, patchbuf, i);
+}
+
 static int
 copy_to_fd (char *from, int tofd)
 {
@@ -663,8 +682,7 @@ copy_to_fd (char *from, int tofd)
   int fromfd = safe_open (from, from_flags, 0);
   if (fromfd < 0)
     pfatal ("Can't reopen file %s", quotearg (from));
-  for (idx_t i; 0 < (i = Read (fromfd, patchbuf, patchbufsize)); )
-    Write (tofd, patchbuf, i);
+  copy_fd (fromfd, tofd);
   return fromfd;
 }
 
@@ -722,8 +740,14 @@ copy_file (char *from, struct stat const *fromst,
   set_file_attributes (to, tofd, attr, from, fromfd, fromst, mode, nullptr);
   if (0 <= fromfd && close (fromfd) < 0)
     read_fatal ();
-  if (0 <= tofd && close (tofd) < 0)
-    write_fatal ();
+  if (0 <= tofd)
+    {
+      if (fsync_output)
+	sync_file (tofd);
+      if (close (tofd) < 0)
+	write_fatal ();
+    }
+  dir_changed (to);
 }
 
 /* Append to file. */
@@ -739,6 +763,8 @@ append_to_file (char *from, char *to)
   int fromfd = copy_to_fd (from, tofd);
   if (close (fromfd) < 0)
     read_fatal ();
+  if (fsync_output)
+    sync_file (tofd);
   if (close (tofd) < 0)
     write_fatal ();
 }
@@ -959,6 +985,33 @@ savebuf (char const *s, idx_t size)
   return size ? xmemdup (s, size) : nullptr;
 }
 
+/* Start CTX on the git object checksum of a blob of SIZE bytes.  */
+
+void
+start_git_blob (struct sha1_ctx *ctx, intmax_t size)
+{
+  char header[sizeof "blob " + INT_STRLEN_BOUND (intmax_t)];
+  sha1_init_ctx (ctx);
+  sha1_process_bytes (header, sprintf (header, "blob %jd", size) + 1, ctx);
+}
+
+/* Does the checksum SUM start with the hex digits in SHA1, of which
+   there are at least MIN?  Git writes full checksums in binary diffs,
+   but abbreviates them in index lines.  */
+
+bool
+sha1_hex_matches (unsigned char const sum[SHA1_DIGEST_SIZE], char const *sha1,
+		  int min)
+{
+  static char const hex[] = "0123456789abcdef";
+  int i;
+  for (i = 0; sha1[i]; i++)
+    if (SHA1_HEX_DIGITS <= i
+	|| sha1[i] != hex[(sum[i >> 1] >> (i & 1 ? 0 : 4)) & 0xf])
+      return false;
+  return min <= i;
+}
+
 /* Terminal output, pun intended. */
 
 void
@@ -1338,10 +1391,11 @@ makedirs (char const *name)
       for (f = filename;  f <= flim;  f++)
 	if (!*f)
 	  {
-	    safe_mkdir (filename,
-		   S_IRUSR|S_IWUSR|S_IXUSR
-		   |S_IRGRP|S_IWGRP|S_IXGRP
-		   |S_IROTH|S_IWOTH|S_IXOTH);
+	    if (safe_mkdir (filename,
+			    S_IRUSR|S_IWUSR|S_IXUSR
+			    |S_IRGRP|S_IWGRP|S_IXGRP
+			    |S_IROTH|S_IWOTH|S_IXOTH) == 0)
+	      dir_changed (filename);
 	    *f = '/';
 	  }
     }
@@ -1367,13 +1421,105 @@ removedirs (char const *name)
 			      || ISSLASH (filename[i - 3])))))))
       {
 	filename[i] = '\0';
-	if (safe_rmdir (filename) == 0 && verbosity == VERBOSE)
-	  say ("Removed empty directory %s\n", quotearg (filename));
+	if (safe_rmdir (filename) == 0)
+	  {
+	    dir_changed (filename);
+	    if (verbosity == VERBOSE)
+	      say ("Removed empty directory %s\n", quotearg (filename));
+	  }
 	filename[i] = '/';
       }
   free (filename);
 }
 
+/* With --fsync, the directories in which entries were added, renamed
+   or removed, each of which is synced once when patch is done.  */
+
+static Hash_table *dirs_to_sync;
+
+static size_t
+dir_hasher (void const *entry, size_t table_size)
+{
+  return hash_string (entry, table_size);
+}
+
+static bool
+dir_comparator (void const *entry1, void const *entry2)
+{
+  return strEQ (entry1, entry2);
+}
+
+/* Note that the entry for NAME in its directory has changed.  */
+
+void
+dir_changed (char const *name)
+{
+  if (! fsync_output)
+    return;
+
+  char const *base = last_component (name);
+  idx_t len = base - name;
+  while (1 < len && ISSLASH (name[len - 1]))
+    len--;
+  char *dir = len ? ximemdup0 (name, len) : xstrdup (".");
+
+  if (!dirs_to_sync)
+    {
+      dirs_to_sync = hash_initialize (0, nullptr, dir_hasher,
+				      dir_comparator, free);
+      if (!dirs_to_sync)
+	xalloc_die ();
+    }
+  void const *found;
+  int r = hash_insert_if_absent (dirs_to_sync, dir, &found);
+  if (r < 0)
+    xalloc_die ();
+  if (r == 0)
+    free (dir);
+}
+
+/* Make sure that the data written to FD is on disk.  Do nothing if FD
+   is something that cannot be synced, such as a pipe.  */
+
+void
+sync_file (int fd)
+{
+#if HAVE_FDATASYNC
+  int r = fdatasync (fd);
+#else
+  int r = fsync (fd);
+#endif
+  if (r < 0 && errno != EINVAL)
+    write_fatal ();
+}
+
+/* Sync each directory noted by dir_changed, so that the changes to
+   their entries are on disk.  Directories that are gone by now were
+   removed, and the removal is synced with their parents.  */
+
+void
+sync_dirs (void)
+{
+  if (!dirs_to_sync)
+    return;
+
+  for (char *dir = hash_get_first (dirs_to_sync); dir;
+       dir = hash_get_next (dirs_to_sync, dir))
+    {
+      int fd = safe_open (dir, O_RDONLY | O_DIRECTORY | O_BINARY, 0);
+      if (fd < 0)
+	{
+	  if (errno != ENOENT)
+	    pfatal ("Can't open directory %s", quotearg (dir));
+	  continue;
+	}
+      if (fsync (fd) < 0 && errno != EINVAL)
+	pfatal ("Can't sync directory %s", quotearg (dir));
+      if (close (fd) < 0)
+	pfatal ("Can't close directory %s", quotearg (dir));
+    }
+}
+
 static struct timespec initial_time;
 
 void
@@ -1715,7 +1861,7 @@ Read (int filedes, void *buf, idx_t nbyte)
   return r;
 }
 
-static void
+void
 Write (int filedes, void const *buf, idx_t nbyte)
 {
   char const *b = buf, *blim = b + nbyte;
@@ -1763,17 +1909,13 @@ try_safe_open (char *template, void *vargs)
   return fd;
 }
 
-int
-make_tempfile (struct outfile *out, char letter, char const *real_name,
-	       int flags, mode_t mode)
+/* Return a template for the name of a temporary file, next to
+   REAL_NAME if given.  */
+
+static char *
+tempfile_template (char letter, char const *real_name)
 {
   char *template;
-  struct try_safe_open_args args = {
-    .out = out,
-    .flags = flags,
-    .mode = mode,
-  };
-  int fd;
 
   if (real_name && ! dry_run)
     {
@@ -1808,11 +1950,104 @@ make_tempfile (struct outfile *out, char letter, char const *real_name,
       template = ximalloc (tmpdirlen + 10);
       sprintf (mempcpy (template, tmpdir, tmpdirlen), "/p%cXXXXXX", letter);
     }
-  fd = try_tempname (template, 0, &args, try_safe_open);
+  return template;
+}
+
+int
+make_tempfile (struct outfile *out, char letter, char const *real_name,
+	       int flags, mode_t mode)
+{
+  char *template = tempfile_template (letter, real_name);
+  struct try_safe_open_args args = {
+    .out = out,
+    .flags = flags,
+    .mode = mode,
+  };
+  int fd = try_tempname (template, 0, &args, try_safe_open);
   out->name = out->alloc = template;
   return fd;
 }
 
+/* Like make_tempfile, but where the system allows, create the file
+   without a name in the directory of REAL_NAME, and open it for
+   reading and writing.  OUT->name is then only the template of the
+   name that link_tempfile gives the file if it is to be kept, and
+   OUT->exists stays null: if the file is not kept, or if patch dies,
+   the file goes away when it is closed.  */
+
+int
+make_unnamed_tempfile (struct outfile *out, char letter,
+		       char const *real_name, int flags, mode_t mode)
+{
+#ifdef O_TMPFILE
+  if (real_name && ! dry_run)
+    {
+      char *template = tempfile_template (letter, real_name);
+      int fd = safe_open_tmpfile (template, (flags & ~O_ACCMODE) | O_RDWR,
+				  mode);
+      if (0 <= fd)
+	{
+	  out->name = out->alloc = template;
+	  out->exists = nullptr;
+	  return fd;
+	}
+      free (template);
+    }
+#endif
+  return make_tempfile (out, letter, real_name, flags, mode);
+}
+
+#ifdef O_TMPFILE
+static int
+try_link_tmpfile (char *template, void *vfd)
+{
+  int *fd = vfd;
+  return safe_link_tmpfile (*fd, template);
+}
+#endif
+
+/* Give the temporary file OUT, open as FD, a name if it has none yet,
+   so that it can be moved into place.  FP, if not null, is a stream on
+   FD; flush it first, so that none of its output is left behind.  If
+   the system cannot link the file, copy it to a new named file, open
+   that as FD instead, and set *ST to its status.  */
+
+void
+link_tempfile (struct outfile *out, FILE *fp, int fd, struct stat *st)
+{
+  if (fp)
+    Fflush (fp);
+  if (out->exists)
+    return;
+
+#ifdef O_TMPFILE
+  defer_signals ();
+  int r = try_tempname (out->name, 0, &fd, try_link_tmpfile);
+  out->exists = r < 0 ? nullptr : volatilize (out->name);
+  undefer_signals ();
+  if (0 <= r)
+    return;
+
+  if (fstat (fd, st) < 0)
+    pfatal ("%s", out->name);
+  idx_t len = strlen (out->name);
+  memset (out->name + len - 6, 'X', 6);
+  struct try_safe_open_args args = {
+    .out = out,
+    .flags = O_WRONLY | binary_transput,
+    .mode = st->st_mode & S_IRWXUGO,
+  };
+  int namedfd = try_tempname (out->name, 0, &args, try_safe_open);
+  if (namedfd < 0)
+    pfatal ("Can't create temporary file %s", out->name);
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    read_fatal ();
+  copy_fd (fd, namedfd);
+  if (dup2 (namedfd, fd) < 0 || close (namedfd) < 0 || fstat (fd, st) < 0)
+    write_fatal ();
+#endif
+}
+
 int
 stat_file (char *filename, struct stat *st)
 {
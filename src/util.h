@@ -19,6 +19,7 @@
 #include <timespec.h>
 #include <stat-time.h>
 #include <backupfile.h>
+#include <sha1.h>
 
 enum file_id_type { UNKNOWN, CREATED, DELETE_LATER, OVERWRITTEN };
 
@@ -38,6 +39,11 @@ enum { EXIT_TROUBLE = 2 };
    when copying files.  See coreutils/src/ioblksize.h.  */
 enum { IO_BUFSIZE = 256 * 1024 };
 
+/* Git abbreviates checksums in index lines to no fewer than
+   SHA1_ABBREV_MIN hex digits; a shorter prefix is too likely to match
+   by chance to be trusted.  Full checksums have SHA1_HEX_DIGITS.  */
+enum { SHA1_ABBREV_MIN = 7, SHA1_HEX_DIGITS = 2 * SHA1_DIGEST_SIZE };
+
 /* POSIX says behavior is implementation-defined for I/O requests
    larger than SSIZE_MAX.  IO_BUFSIZE is OK on all known platforms.
    Check it to be sure.  */
@@ -69,6 +75,9 @@ _Noreturn void pfatal (char const *, ...) ATTRIBUTE_FORMAT ((printf, 1, 2));
 
 void fetchname (char const *, intmax_t, char **, char **, struct timespec *);
 char *parse_name (char const *, intmax_t, char const **);
+void start_git_blob (struct sha1_ctx *, intmax_t);
+bool sha1_hex_matches (unsigned char const[SHA1_DIGEST_SIZE], char const *,
+		       int) ATTRIBUTE_PURE;
 char *savebuf (char const *, idx_t)
   ATTRIBUTE_MALLOC ATTRIBUTE_DEALLOC_FREE ATTRIBUTE_ALLOC_SIZE ((2));
 char const *version_controller (char const *, bool, struct stat const *, char **, char **);
@@ -84,9 +93,11 @@ void Fseeko (FILE *, off_t, int);
 off_t Ftello (FILE *);
 void Fwrite (void const *restrict, size_t, size_t, FILE *restrict);
 idx_t Read (int, void *, idx_t);
+void Write (int, void const *, idx_t);
 void copy_file (char *, struct stat const *, struct outfile *, struct stat *,
 		int, mode_t, enum file_attributes, bool);
 void append_to_file (char *, char *);
+void copy_fd (int, int);
 idx_t quote_system_arg (char *, char const *);
 void init_signals (void);
 void defer_signals (void);
@@ -99,6 +110,9 @@ void move_file (struct outfile *, struct stat const *,
 		char *, mode_t, bool);
 _Noreturn void read_fatal (void);
 void removedirs (char const *);
+void dir_changed (char const *);
+void sync_file (int);
+void sync_dirs (void);
 _Noreturn void write_fatal (void);
 void putline (FILE *, ...);
 void insert_file_id (struct stat const *, enum file_id_type);
@@ -113,5 +127,7 @@ void set_file_attributes (char *, int, enum file_attributes, char const *, int,
 			  const struct stat *, mode_t, struct timespec *);
 
 int make_tempfile (struct outfile *, char, char const *, int, mode_t);
+int make_unnamed_tempfile (struct outfile *, char, char const *, int, mode_t);
+void link_tempfile (struct outfile *, FILE *, int, struct stat *);
 
 _GL_INLINE_HEADER_END